@@ -1,5 +1,4 @@
 #include <SPI.h>
-#include <EEPROM.h>
 #include "boards.h"
 #include "lib_aci.h"
 #include "aci_setup.h"
@@ -7,206 +6,260 @@
 
 #include "blue_cap_peripheral.h"
 
+#if BOND_DATA_BYTES > 255
+#error "BOND_DATA_BYTES must fit the one byte record size field"
+#endif
+
 BlueCapPeripheral::BlueCapBond::BlueCapBond() {
+  static_assert(sizeof(BlueCapBond) <= BOND_STATE_BYTES, "BlueCapBond exceeds BOND_STATE_BYTES");
 }
 
-void BlueCapPeripheral::BlueCapBond::init(BlueCapPeripheral* _peripheral, uint16_t _eepromOffset, uint16_t _maxBonds, uint8_t _index) {
-  eepromOffset = _eepromOffset;
-  index = _index;
-  maxBonds = _maxBonds;
-  newBond = false;
-  peripheral = _peripheral;
-  if (status() == 0x00) {
-    bonded = false;
-  } else {
-    bonded = true;
-  }
+void BlueCapPeripheral::BlueCapBond::init(BlueCapPeripheral* peripheral) {
+  header = 0x00;
+  dataSize = 0;
+  readBondDirectory(peripheral);
 }
 
-void  BlueCapPeripheral::BlueCapBond::clearBondData() {
-    EEPROM.write(offset(), 0x00);
+void  BlueCapPeripheral::BlueCapBond::clearBondData(BlueCapPeripheral* peripheral) {
+  if (header != 0x00) {
+    peripheral->bondStore->write(offset(peripheral, activeSlot) + BOND_RECORD_MARKER, BOND_RECORD_CLEARED);
+    peripheral->bondStore->flush();
+    header = 0x00;
+  }
+  peripheral->setBondState(index(peripheral), false, false);
 }
 
 void  BlueCapPeripheral::BlueCapBond::setup(aci_state_t* aciState) {
   aciState->bonded = ACI_BOND_STATUS_FAILED;
 }
 
-bool BlueCapPeripheral::BlueCapBond::restoreIfBonded(aci_state_t* aciState) {
-  bool result = true;
-  if (bonded) {
-    DBUG_LOG(F("Previous Bond present. Restoring"));
-    if (ACI_STATUS_TRANSACTION_COMPLETE == restoreBondData(aciState)) {
-      DBUG_LOG(F("Bond restored successfully: Waiting for connection"));
-      // prevents HW error
-      delay(2000);
-    }
-    else {
-      ERROR_LOG(F("Bond restore failed. Delete the bond and try again."));
-      result = false;
-    }
+bool BlueCapPeripheral::BlueCapBond::restoreIfBonded(BlueCapPeripheral* peripheral, aci_state_t* aciState) {
+  if (!peripheral->isBonded(index(peripheral))) {
+    return false;
   }
-  return result;
+  BOND_DBUG_LOG(F("Previous Bond present. Restoring"));
+  peripheral->startBondOperation(BOND_RESTORING, readBondDataOffset(peripheral), status() & 0x7F);
+  if (!sendBondData(peripheral)) {
+    BOND_ERROR_LOG(F("restoreBondData: failed"));
+    peripheral->finishBondOperation(false);
+  }
+  return true;
 }
 
-void BlueCapPeripheral::BlueCapBond::writeIfBonded(aci_state_t* aciState, aci_evt_t* aciEvt) {
-  if (ACI_BOND_STATUS_SUCCESS == aciState->bonded) {
-    DBUG_LOG(F("ACI_BOND_STATUS_SUCCESS"));
+bool BlueCapPeripheral::BlueCapBond::writeIfBonded(BlueCapPeripheral* peripheral, aci_state_t* aciState, aci_evt_t* aciEvt) {
+  if (ACI_BOND_STATUS_SUCCESS == aciState->bonded && peripheral->bondStore != NULL) {
+    BOND_DBUG_LOG(F("ACI_BOND_STATUS_SUCCESS"));
     aciState->bonded = ACI_BOND_STATUS_FAILED;
     if (ACI_STATUS_EXTENDED == aciEvt->params.disconnected.aci_status) {
-      if (!bonded) {
-        if (readAndWriteBondData(aciState)) {
-          bonded = true;
-          DBUG_LOG(F("Bond data read and store successful"));
-          // prevents HW error
-          delay(1000);
-        } else {
-          ERROR_LOG(F("Bond data read and store failed"));
+      if (!peripheral->isBonded(index(peripheral))) {
+        uint8_t slot = (activeSlot + 1) % BOND_SLOTS;
+        peripheral->bondStore->write(offset(peripheral, slot) + BOND_RECORD_MARKER, BOND_RECORD_WRITING);
+        peripheral->bondStore->flush();
+        peripheral->startBondOperation(BOND_SAVING, offset(peripheral, slot) + BOND_RECORD_HEADER_BYTES, 1);
+        peripheral->bonding->bondSlot = slot;
+        peripheral->bonding->bondCrc = 0xFFFF;
+        if (!lib_aci_read_dynamic_data()) {
+          BOND_ERROR_LOG(F("Bond data read failed"));
+          peripheral->finishBondOperation(false);
         }
+        return true;
       }
     }
   }
+  return false;
 }
 
-// private
-aci_status_code_t  BlueCapPeripheral::BlueCapBond::restoreBondData(aci_state_t* aciState) {
-  aci_evt_t *aciEvt;
-  uint16_t addr = readBondDataOffset();
-  uint8_t numDynMsgs = status() & 0x7F;
-  hal_aci_data_t aciCmd;
-
-  while(1) {
-
-    addr = readBondData(&aciCmd, addr);
+void BlueCapPeripheral::BlueCapBond::didReceiveCommandResponse(BlueCapPeripheral* peripheral, aci_state_t* aciState, aci_evt_t* aciEvt) {
+  if (BOND_RESTORING == peripheral->bonding->bondOperation) {
+    restoreBondData(peripheral, aciState, aciEvt);
+  } else {
+    readAndWriteBondData(peripheral, aciEvt);
+  }
+}
 
-    if (!hal_aci_tl_send(&aciCmd)) {
-      ERROR_LOG(F("restoreBondData: failed"));
-      return ACI_STATUS_ERROR_INTERNAL;
-    }
-    // prevents HW error
-    delay(1000);
-
-    while (1) {
-      if (lib_aci_event_get(aciState, &aciData)) {
-        aciEvt = &aciData.evt;
-        if (ACI_EVT_CMD_RSP != aciEvt->evt_opcode) {
-            ERROR_LOG(F("restoreBondData: failed with error: 0x"));
-            ERROR_LOG(aciEvt->evt_opcode, HEX);
-            return ACI_STATUS_ERROR_INTERNAL;
-        } else {
-          if (ACI_STATUS_TRANSACTION_COMPLETE == aciEvt->params.cmd_rsp.cmd_status) {
-            bonded = true;
-            aciState->bonded = ACI_BOND_STATUS_SUCCESS;
-            DBUG_LOG(F("Restore of bond data completed successfully"));
-            return ACI_STATUS_TRANSACTION_COMPLETE;
-          } else if (ACI_STATUS_TRANSACTION_CONTINUE == aciEvt->params.cmd_rsp.cmd_status) {
-            numDynMsgs--;
-            break;
-          } else if (0 >= numDynMsgs) {
-            ERROR_LOG(F("Restore of bond data failed with too many messages"));
-            return ACI_STATUS_ERROR_INTERNAL;
-          } else {
-            ERROR_LOG(F("Restore of bond data failed with cmd_status:"));
-            ERROR_LOG(aciEvt->params.cmd_rsp.cmd_status, HEX);
-            return ACI_STATUS_ERROR_INTERNAL;
-          }
-        }
-      }
-    }
+// private
+void BlueCapPeripheral::BlueCapBond::restoreBondData(BlueCapPeripheral* peripheral, aci_state_t* aciState, aci_evt_t* aciEvt) {
+  uint8_t cmdStatus = aciEvt->params.cmd_rsp.cmd_status;
+  if (ACI_STATUS_TRANSACTION_COMPLETE == cmdStatus) {
+    aciState->bonded = ACI_BOND_STATUS_SUCCESS;
+    BOND_DBUG_LOG(F("Restore of bond data completed successfully"));
+    peripheral->finishBondOperation(true);
+  } else if (ACI_STATUS_TRANSACTION_CONTINUE != cmdStatus) {
+    BOND_ERROR_LOG(F("Restore of bond data failed with cmd_status:"));
+    BOND_ERROR_LOG(cmdStatus, HEX);
+    peripheral->finishBondOperation(false);
+  } else if (--peripheral->bonding->bondMessageCount == 0) {
+    BOND_ERROR_LOG(F("Restore of bond data failed with too many messages"));
+    peripheral->finishBondOperation(false);
+  } else if (!sendBondData(peripheral)) {
+    BOND_ERROR_LOG(F("restoreBondData: failed"));
+    peripheral->finishBondOperation(false);
   }
 }
 
-bool  BlueCapPeripheral::BlueCapBond::readAndWriteBondData(aci_state_t* aciState) {
-  bool status = false;
-  aci_evt_t* aciEvt = NULL;
-  uint8_t numDynMsgs = 0;
-  uint16_t addr = readBondDataOffset();
-
-  lib_aci_read_dynamic_data();
-  numDynMsgs++;
-
-  while (1) {
-    if (lib_aci_event_get(aciState, &aciData)) {
-      aciEvt = &aciData.evt;
-      if (ACI_EVT_CMD_RSP != aciEvt->evt_opcode ) {
-        ERROR_LOG(F("readAndWriteBondData command response failed:"));
-        ERROR_LOG(aciEvt->evt_opcode, HEX);
-        status = false;
-        break;
-      } else if (ACI_STATUS_TRANSACTION_COMPLETE == aciEvt->params.cmd_rsp.cmd_status) {
-        addr = writeBondData(aciEvt, addr);
-        writeBondDataHeader(addr, numDynMsgs);
-        status = true;
-        break;
-      } else if (!(ACI_STATUS_TRANSACTION_CONTINUE == aciEvt->params.cmd_rsp.cmd_status)) {
-        ERROR_LOG(F("readAndWriteBondData transaction failed:"));
-        ERROR_LOG(aciEvt->params.cmd_rsp.cmd_status, HEX);
-        clearBondData();
-        status = false;
-        break;
-      } else {
-        addr = writeBondData(aciEvt, addr);
-        lib_aci_read_dynamic_data();
-        numDynMsgs++;
-      }
-      // prevents HW errors
-      delay(1000);
+void BlueCapPeripheral::BlueCapBond::readAndWriteBondData(BlueCapPeripheral* peripheral, aci_evt_t* aciEvt) {
+  uint8_t cmdStatus = aciEvt->params.cmd_rsp.cmd_status;
+  if (ACI_STATUS_TRANSACTION_COMPLETE != cmdStatus && ACI_STATUS_TRANSACTION_CONTINUE != cmdStatus) {
+    BOND_ERROR_LOG(F("readAndWriteBondData transaction failed:"));
+    BOND_ERROR_LOG(cmdStatus, HEX);
+    peripheral->finishBondOperation(false);
+  } else if (!writeBondData(peripheral, aciEvt)) {
+    BOND_ERROR_LOG(F("readAndWriteBondData bond data exceeds BOND_DATA_BYTES"));
+    peripheral->finishBondOperation(false);
+  } else if (ACI_STATUS_TRANSACTION_COMPLETE == cmdStatus) {
+    writeBondDataHeader(peripheral, peripheral->bonding->bondDataAddress, peripheral->bonding->bondMessageCount);
+    peripheral->setBondState(index(peripheral), true, false);
+    BOND_DBUG_LOG(F("Bond data read and store successful"));
+    peripheral->finishBondOperation(true);
+  } else {
+    peripheral->bonding->bondMessageCount++;
+    if (!lib_aci_read_dynamic_data()) {
+      BOND_ERROR_LOG(F("Bond data read failed"));
+      peripheral->finishBondOperation(false);
     }
   }
-  return status;
 }
 
-uint16_t  BlueCapPeripheral::BlueCapBond::writeBondData(aci_evt_t* evt, uint16_t addr) {
-  EEPROM.write(addr, evt->len - 2);
-  addr++;
-  EEPROM.write(addr, ACI_CMD_WRITE_DYNAMIC_DATA);
-  addr++;
-  for (uint8_t i=0; i< (evt->len-3); i++) {
-    EEPROM.write(addr, evt->params.cmd_rsp.params.padding[i]);
-    addr++;
+bool BlueCapPeripheral::BlueCapBond::sendBondData(BlueCapPeripheral* peripheral) {
+  hal_aci_data_t aciCmd;
+  peripheral->bonding->bondDataAddress = readBondData(peripheral, &aciCmd, peripheral->bonding->bondDataAddress);
+  return hal_aci_tl_send(&aciCmd);
+}
+
+bool BlueCapPeripheral::BlueCapBond::writeBondData(BlueCapPeripheral* peripheral, aci_evt_t* evt) {
+  uint8_t data[HAL_ACI_MAX_LENGTH];
+  uint8_t len = evt->len - 2;
+  uint16_t addr = peripheral->bonding->bondDataAddress;
+  if (len + 1 > HAL_ACI_MAX_LENGTH || addr + len + 1 > offset(peripheral, peripheral->bonding->bondSlot) + BOND_RECORD_BYTES) {
+    return false;
   }
-  return addr;
+  data[0] = len;
+  data[1] = ACI_CMD_WRITE_DYNAMIC_DATA;
+  memcpy(data + 2, evt->params.cmd_rsp.params.padding, len - 1);
+  peripheral->bondStore->writeBlock(addr, data, len + 1);
+  for (uint8_t i = 0; i <= len; i++) {
+    peripheral->bonding->bondCrc = updateCrc(peripheral->bonding->bondCrc, data[i]);
+  }
+  peripheral->bonding->bondDataAddress = addr + len + 1;
+  return true;
 }
 
-uint16_t BlueCapPeripheral::BlueCapBond::readBondData(hal_aci_data_t* aciCmd, uint16_t addr) {
-  uint8_t len = EEPROM.read(addr);
+uint16_t BlueCapPeripheral::BlueCapBond::readBondData(BlueCapPeripheral* peripheral, hal_aci_data_t* aciCmd, uint16_t addr) {
+  uint8_t len = peripheral->bondStore->read(addr);
   addr++;
-  aciCmd->buffer[0] = len;
-  for (uint8_t i = 1; i <= len; i++) {
-      aciCmd->buffer[i] = EEPROM.read(addr);
-      addr++;
+  if (len > HAL_ACI_MAX_LENGTH) {
+    len = HAL_ACI_MAX_LENGTH;
   }
-  return addr;
+  aciCmd->buffer[0] = len;
+  peripheral->bondStore->readBlock(addr, aciCmd->buffer + 1, len);
+  return addr + len;
 }
 
-void BlueCapPeripheral::BlueCapBond::connectOrBond() {
-  if (bonded) {
-    peripheral->connect();
-    DBUG_LOG(F("Advertising started. Waiting for connection with bond:"));
+void BlueCapPeripheral::BlueCapBond::connectOrBond(BlueCapPeripheral* peripheral) {
+  if (peripheral->isBonded(index(peripheral))) {
+    peripheral->connectBond();
+    BOND_DBUG_LOG(F("Advertising started. Waiting for connection with bond:"));
   } else {
     peripheral->bond();
-    DBUG_LOG(F("Advertising started : Waiting for connection and bonding with bond:"));
+    BOND_DBUG_LOG(F("Advertising started : Waiting for connection and bonding with bond:"));
   }
-  DBUG_LOG(index, DEC);
+  BOND_DBUG_LOG(index(peripheral), DEC);
 }
 
-void BlueCapPeripheral::BlueCapBond::writeBondDataHeader(uint16_t dataAddress, uint8_t numDynMsgs) {
-  uint8_t dataSize = dataAddress - readBondDataOffset();
-  EEPROM.write(offset(), 0x80 | numDynMsgs);
-  EEPROM.write(offset() + 1, dataSize);
+void BlueCapPeripheral::BlueCapBond::writeBondDataHeader(BlueCapPeripheral* peripheral, uint16_t dataAddress, uint8_t numDynMsgs) {
+  uint8_t slot = peripheral->bonding->bondSlot;
+  uint16_t recordOffset = offset(peripheral, slot);
+  uint8_t recordHeader[BOND_RECORD_CRC] = {0};
+  recordHeader[BOND_RECORD_SEQUENCE] = sequence + 1;
+  recordHeader[BOND_RECORD_MESSAGES] = numDynMsgs;
+  recordHeader[BOND_RECORD_SIZE] = dataAddress - recordOffset - BOND_RECORD_HEADER_BYTES;
+  uint16_t crc = peripheral->bonding->bondCrc;
+  for (uint8_t i = BOND_RECORD_SEQUENCE; i < BOND_RECORD_CRC; i++) {
+    crc = updateCrc(crc, recordHeader[i]);
+  }
+  BlueCapBondStore* store = peripheral->bondStore;
+  store->writeBlock(recordOffset + BOND_RECORD_SEQUENCE, recordHeader + BOND_RECORD_SEQUENCE, BOND_RECORD_CRC - BOND_RECORD_SEQUENCE);
+  store->write(recordOffset + BOND_RECORD_CRC, crc & 0xFF);
+  store->write(recordOffset + BOND_RECORD_CRC + 1, crc >> 8);
+  store->flush();
+  store->write(recordOffset + BOND_RECORD_MARKER, BOND_RECORD_COMMITTED);
+  store->flush();
+  activeSlot = slot;
+  sequence = recordHeader[BOND_RECORD_SEQUENCE];
+  dataSize = recordHeader[BOND_RECORD_SIZE];
+  header = 0x80 | numDynMsgs;
 }
 
-uint16_t BlueCapPeripheral::BlueCapBond::readBondDataOffset() {
-  uint16_t bondOffset = eepromOffset + maxBonds*BOND_HEADER_BYTES;
-  for (int i = 0; i < index; i++) {
-    bondOffset += EEPROM.read(eepromOffset + i*BOND_HEADER_BYTES + 1);
+void BlueCapPeripheral::BlueCapBond::readBondDirectory(BlueCapPeripheral* peripheral) {
+  BlueCapBondStore* store = peripheral->bondStore;
+  uint8_t recordHeader[BOND_RECORD_HEADER_BYTES];
+  bool found = false;
+  header = 0x00;
+  dataSize = 0;
+  activeSlot = BOND_SLOTS - 1;
+  sequence = 0;
+  for (uint8_t slot = 0; store != NULL && slot < BOND_SLOTS; slot++) {
+    store->readBlock(offset(peripheral, slot), recordHeader, BOND_RECORD_HEADER_BYTES);
+    uint8_t marker = recordHeader[BOND_RECORD_MARKER];
+    if (BOND_RECORD_COMMITTED != marker && BOND_RECORD_CLEARED != marker) {
+      continue;
+    }
+    if (found && (int8_t)(recordHeader[BOND_RECORD_SEQUENCE] - sequence) <= 0) {
+      continue;
+    }
+    found = true;
+    activeSlot = slot;
+    sequence = recordHeader[BOND_RECORD_SEQUENCE];
+    header = 0x00;
+    if (BOND_RECORD_COMMITTED == marker && isValidRecord(peripheral, offset(peripheral, slot), recordHeader)) {
+      header = 0x80 | recordHeader[BOND_RECORD_MESSAGES];
+      dataSize = recordHeader[BOND_RECORD_SIZE];
+    }
   }
-  return bondOffset;
+  peripheral->setBondState(index(peripheral), header != 0x00, false);
+}
+
+bool BlueCapPeripheral::BlueCapBond::isValidRecord(BlueCapPeripheral* peripheral, uint16_t recordOffset, uint8_t* recordHeader) {
+  uint8_t size = recordHeader[BOND_RECORD_SIZE];
+  if (size > BOND_DATA_BYTES) {
+    return false;
+  }
+  uint8_t data[16];
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = 0; i < size; i += sizeof(data)) {
+    uint8_t count = size - i;
+    if (count > sizeof(data)) {
+      count = sizeof(data);
+    }
+    peripheral->bondStore->readBlock(recordOffset + BOND_RECORD_HEADER_BYTES + i, data, count);
+    for (uint8_t j = 0; j < count; j++) {
+      crc = updateCrc(crc, data[j]);
+    }
+  }
+  for (uint8_t i = BOND_RECORD_SEQUENCE; i < BOND_RECORD_CRC; i++) {
+    crc = updateCrc(crc, recordHeader[i]);
+  }
+  uint16_t storedCrc = recordHeader[BOND_RECORD_CRC] | (recordHeader[BOND_RECORD_CRC + 1] << 8);
+  if (crc != storedCrc) {
+    BOND_ERROR_LOG(F("Bond record CRC mismatch, bond:"));
+    BOND_ERROR_LOG(index(peripheral), DEC);
+    return false;
+  }
+  return true;
+}
+
+uint16_t BlueCapPeripheral::BlueCapBond::readBondDataOffset(BlueCapPeripheral* peripheral) {
+  return offset(peripheral, activeSlot) + BOND_RECORD_HEADER_BYTES;
 }
 
 uint8_t  BlueCapPeripheral::BlueCapBond::status() {
-  return EEPROM.read(offset());
+  return header;
 }
 
-uint16_t BlueCapPeripheral::BlueCapBond::offset() {
-  return eepromOffset + index*BOND_HEADER_BYTES;
-}
\ No newline at end of file
+uint16_t BlueCapPeripheral::BlueCapBond::offset(BlueCapPeripheral* peripheral, uint8_t slot) {
+  return peripheral->bonding->bondOffset + (index(peripheral)*BOND_SLOTS + slot)*BOND_RECORD_BYTES;
+}
+
+uint8_t BlueCapPeripheral::BlueCapBond::index(BlueCapPeripheral* peripheral) {
+  return this - peripheral->bonding->bonds;
+}
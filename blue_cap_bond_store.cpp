@@ -0,0 +1,120 @@
+#include <string.h>
+#if defined(ARDUINO)
+#include <EEPROM.h>
+#endif
+
+#include "blue_cap_bond_store.h"
+
+uint16_t updateCrc(uint16_t crc, uint8_t data) {
+  crc ^= (uint16_t)data << 8;
+  for (uint8_t i = 0; i < 8; i++) {
+    if (crc & 0x8000) {
+      crc = (crc << 1) ^ 0x1021;
+    } else {
+      crc <<= 1;
+    }
+  }
+  return crc;
+}
+
+// BlueCapBondStore
+BlueCapBondStore::BlueCapBondStore() {
+  written = 0;
+}
+
+void BlueCapBondStore::readBlock(uint16_t addr, uint8_t* buffer, uint16_t size) {
+  for (uint16_t i = 0; i < size; i++) {
+    buffer[i] = read(addr + i);
+  }
+}
+
+void BlueCapBondStore::writeBlock(uint16_t addr, const uint8_t* buffer, uint16_t size) {
+  for (uint16_t i = 0; i < size; i++) {
+    write(addr + i, buffer[i]);
+  }
+}
+
+uint32_t BlueCapBondStore::bytesWritten() {
+  return written;
+}
+
+// BlueCapEEPROMStore
+#if defined(ARDUINO)
+uint8_t BlueCapEEPROMStore::read(uint16_t addr) {
+  return EEPROM.read(addr);
+}
+
+void BlueCapEEPROMStore::write(uint16_t addr, uint8_t value) {
+  if (EEPROM.read(addr) != value) {
+    EEPROM.write(addr, value);
+    written++;
+  }
+}
+#endif
+
+// BlueCapPagedStore
+BlueCapPagedStore::BlueCapPagedStore(uint8_t* _pageBuffer, uint16_t _pageSize) {
+  pageBuffer = _pageBuffer;
+  pageSize = _pageSize;
+  currentPage = 0;
+  pageLoaded = false;
+  pageDirty = false;
+}
+
+uint8_t BlueCapPagedStore::read(uint16_t addr) {
+  loadPage(addr / pageSize);
+  return pageBuffer[addr % pageSize];
+}
+
+void BlueCapPagedStore::write(uint16_t addr, uint8_t value) {
+  loadPage(addr / pageSize);
+  if (pageBuffer[addr % pageSize] != value) {
+    pageBuffer[addr % pageSize] = value;
+    pageDirty = true;
+  }
+}
+
+void BlueCapPagedStore::readBlock(uint16_t addr, uint8_t* buffer, uint16_t size) {
+  while (size > 0) {
+    loadPage(addr / pageSize);
+    uint16_t pageOffset = addr % pageSize;
+    uint16_t count = pageSize - pageOffset < size ? pageSize - pageOffset : size;
+    memcpy(buffer, pageBuffer + pageOffset, count);
+    addr += count;
+    buffer += count;
+    size -= count;
+  }
+}
+
+void BlueCapPagedStore::writeBlock(uint16_t addr, const uint8_t* buffer, uint16_t size) {
+  while (size > 0) {
+    loadPage(addr / pageSize);
+    uint16_t pageOffset = addr % pageSize;
+    uint16_t count = pageSize - pageOffset < size ? pageSize - pageOffset : size;
+    if (memcmp(pageBuffer + pageOffset, buffer, count) != 0) {
+      memcpy(pageBuffer + pageOffset, buffer, count);
+      pageDirty = true;
+    }
+    addr += count;
+    buffer += count;
+    size -= count;
+  }
+}
+
+void BlueCapPagedStore::flush() {
+  if (pageDirty) {
+    writePage(currentPage, pageBuffer);
+    written += pageSize;
+    pageDirty = false;
+  }
+}
+
+void BlueCapPagedStore::loadPage(uint16_t page) {
+  if (pageLoaded && page == currentPage) {
+    return;
+  }
+  flush();
+  readPage(page, pageBuffer);
+  currentPage = page;
+  pageLoaded = true;
+}
@@ -0,0 +1,96 @@
+#ifndef _BLUE_CAP_BOND_STORE_H
+#define _BLUE_CAP_BOND_STORE_H
+
+#include <stdint.h>
+
+uint16_t updateCrc(uint16_t crc, uint8_t data);
+
+class BlueCapBondStore {
+
+public:
+
+  BlueCapBondStore();
+
+  virtual uint8_t read(uint16_t addr) = 0;
+  virtual void write(uint16_t addr, uint8_t value) = 0;
+  virtual void readBlock(uint16_t addr, uint8_t* buffer, uint16_t size);
+  virtual void writeBlock(uint16_t addr, const uint8_t* buffer, uint16_t size);
+  virtual void flush(){};
+
+  uint32_t bytesWritten();
+
+protected:
+
+  uint32_t                written;
+
+};
+
+#if defined(ARDUINO)
+class BlueCapEEPROMStore : public BlueCapBondStore {
+
+public:
+
+  virtual uint8_t read(uint16_t addr);
+  virtual void write(uint16_t addr, uint8_t value);
+
+};
+#endif
+
+class BlueCapPagedStore : public BlueCapBondStore {
+
+public:
+
+  BlueCapPagedStore(uint8_t* _pageBuffer, uint16_t _pageSize);
+
+  virtual uint8_t read(uint16_t addr);
+  virtual void write(uint16_t addr, uint8_t value);
+  virtual void readBlock(uint16_t addr, uint8_t* buffer, uint16_t size);
+  virtual void writeBlock(uint16_t addr, const uint8_t* buffer, uint16_t size);
+  virtual void flush();
+
+protected:
+
+  virtual void readPage(uint16_t page, uint8_t* buffer) = 0;
+  virtual void writePage(uint16_t page, const uint8_t* buffer) = 0;
+
+private:
+
+  uint8_t*                pageBuffer;
+  uint16_t                pageSize;
+  uint16_t                currentPage;
+  bool                    pageLoaded;
+  bool                    pageDirty;
+
+private:
+
+  void loadPage(uint16_t page);
+
+};
+
+#if !defined(ARDUINO)
+class BlueCapFileStore : public BlueCapBondStore {
+
+public:
+
+  BlueCapFileStore();
+  ~BlueCapFileStore();
+
+  bool open(const char* path, uint16_t size);
+  void close();
+
+  virtual uint8_t read(uint16_t addr);
+  virtual void write(uint16_t addr, uint8_t value);
+  virtual void readBlock(uint16_t addr, uint8_t* buffer, uint16_t size);
+  virtual void writeBlock(uint16_t addr, const uint8_t* buffer, uint16_t size);
+  virtual void flush();
+
+private:
+
+  uint8_t*                data;
+  uint16_t                dataSize;
+  int                     fd;
+
+};
+#endif
+
+#endif
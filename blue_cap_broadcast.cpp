@@ -0,0 +1,168 @@
+#include <SPI.h>
+#include "boards.h"
+#include "lib_aci.h"
+#include "aci_setup.h"
+#include "utils.h"
+
+#include "blue_cap_peripheral.h"
+
+void BlueCapPeripheral::setBroadcastWindow(uint16_t seconds, uint16_t interval) {
+  if (!broadcastEnabled()) {
+    return;
+  }
+  broadcasting->seconds = seconds;
+  broadcasting->interval = interval;
+}
+
+bool BlueCapPeripheral::setBroadcastFrames(BlueCapBroadcastFrame* frames, uint8_t count) {
+  if (!broadcastEnabled()) {
+    COMMAND_ERROR_LOG(F("setBroadcastFrames: not a broadcasting peripheral"));
+    return false;
+  }
+  if ((frames == NULL) != (count == 0)) {
+    COMMAND_ERROR_LOG(F("setBroadcastFrames: frames and count must both be set"));
+    return false;
+  }
+  broadcasting->frames = frames;
+  broadcasting->frameSlots = count;
+  clearBroadcastFrames();
+  return true;
+}
+
+bool BlueCapPeripheral::setBroadcastFrame(uint8_t frame, uint8_t pipe, uint8_t* data, uint8_t size, uint16_t dwellMilliseconds) {
+  if (!broadcastEnabled() || frame >= broadcasting->frameSlots || frame > broadcasting->frameCount) {
+    COMMAND_ERROR_LOG(F("setBroadcastFrame: invalid frame"));
+    return false;
+  }
+  if (size > ACI_PIPE_TX_DATA_MAX_LEN) {
+    COMMAND_ERROR_LOG(F("setBroadcastFrame: size too large"));
+    return false;
+  }
+  BlueCapBroadcastFrame* entry = &broadcasting->frames[frame];
+  if (frame == broadcasting->frameCount) {
+    broadcasting->frameCount++;
+    entry->pushed = false;
+  } else if (entry->pipe == pipe && entry->size == size && memcmp(entry->data, data, size) == 0) {
+    entry->dwellMilliseconds = dwellMilliseconds;
+    broadcasting->skips++;
+    return true;
+  } else {
+    entry->pushed = false;
+  }
+  if (frame == broadcasting->pushFrame) {
+    broadcasting->pushChanged = true;
+  }
+  entry->pipe = pipe;
+  entry->size = size;
+  entry->dwellMilliseconds = dwellMilliseconds;
+  memcpy(entry->data, data, size);
+  if (frame == broadcasting->currentFrame) {
+    pushBroadcastFrame();
+  }
+  return true;
+}
+
+void BlueCapPeripheral::clearBroadcastFrames() {
+  if (!broadcastEnabled()) {
+    return;
+  }
+  broadcasting->pushChanged = true;
+  broadcasting->frameCount = 0;
+  broadcasting->currentFrame = 0;
+}
+
+uint8_t BlueCapPeripheral::broadcastFrame() {
+  return broadcastEnabled() ? broadcasting->currentFrame : 0;
+}
+
+uint16_t BlueCapPeripheral::broadcastSkippedUpdates() {
+  return broadcastEnabled() ? broadcasting->skips : 0;
+}
+
+// private
+void BlueCapPeripheral::initBroadcast() {
+  if (broadcasting == NULL) {
+    return;
+  }
+  broadcasting->seconds = BROADCAST_TIMEOUT_SECONDS;
+  broadcasting->interval = BROADCAST_ADVERTISING_INTERVAL_MILISECONDS;
+  broadcasting->frames = NULL;
+  broadcasting->frameSlots = 0;
+  broadcasting->frameCount = 0;
+  broadcasting->currentFrame = 0;
+  broadcasting->frameAt = 0;
+  broadcasting->skips = 0;
+  broadcasting->pushFrame = NO_BROADCAST_FRAME;
+  broadcasting->pushPosition = 0;
+  broadcasting->pushChanged = false;
+}
+
+void BlueCapPeripheral::resetBroadcastFrames() {
+  for (uint8_t i = 0; broadcastEnabled() && i < broadcasting->frameCount; i++) {
+    broadcasting->frames[i].pushed = false;
+  }
+}
+
+void BlueCapPeripheral::manageBroadcast() {
+  if (!broadcastEnabled() || broadcasting->frameCount == 0 || !deviceStarted || radioAsleep) {
+    return;
+  }
+  uint32_t now = millis();
+  if (broadcasting->frameAt == 0) {
+    broadcasting->frameAt = now;
+  }
+  if (broadcasting->frameCount > 1 && now - broadcasting->frameAt >= broadcasting->frames[broadcasting->currentFrame].dwellMilliseconds) {
+    broadcasting->currentFrame = (broadcasting->currentFrame + 1) % broadcasting->frameCount;
+    broadcasting->frameAt = now;
+  }
+  pushBroadcastFrame();
+}
+
+void BlueCapPeripheral::pushBroadcastFrame() {
+  // before begin() or while asleep the command would be failed by DEVICE_STARTED
+  if (!deviceStarted || radioAsleep || NO_BROADCAST_FRAME != broadcasting->pushFrame) {
+    return;
+  }
+  BlueCapBroadcastFrame* entry = &broadcasting->frames[broadcasting->currentFrame];
+  if (entry->pushed || commandQueueCount == commandQueueSize) {
+    return;
+  }
+  if (queueSetData(entry->pipe, entry->data, entry->size)) {
+    // the queue is FIFO, count the commands ahead of this one
+    broadcasting->pushFrame = broadcasting->currentFrame;
+    broadcasting->pushPosition = commandQueueCount - 1;
+    broadcasting->pushChanged = false;
+    COMMAND_DBUG_LOG(F("Broadcast frame:"));
+    COMMAND_DBUG_LOG(broadcasting->currentFrame, DEC);
+  }
+}
+
+// called for every command leaving the queue, pushed is only set once the
+// frame's SetLocalData has succeeded
+void BlueCapPeripheral::completeBroadcastPush(bool success) {
+  if (!broadcastEnabled() || NO_BROADCAST_FRAME == broadcasting->pushFrame) {
+    return;
+  }
+  if (broadcasting->pushPosition > 0) {
+    broadcasting->pushPosition--;
+    return;
+  }
+  uint8_t frame = broadcasting->pushFrame;
+  broadcasting->pushFrame = NO_BROADCAST_FRAME;
+  if (broadcasting->pushChanged || frame >= broadcasting->frameCount) {
+    return;
+  }
+  BlueCapBroadcastFrame* entry = &broadcasting->frames[frame];
+  if (!success) {
+    COMMAND_ERROR_LOG(F("Broadcast frame push failed:"));
+    COMMAND_ERROR_LOG(frame, DEC);
+    entry->pushed = false;
+    return;
+  }
+  for (uint8_t i = 0; i < broadcasting->frameCount; i++) {
+    if (broadcasting->frames[i].pipe == entry->pipe) {
+      broadcasting->frames[i].pushed = false;
+    }
+  }
+  entry->pushed = true;
+}
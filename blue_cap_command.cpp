@@ -0,0 +1,175 @@
+#include <SPI.h>
+#include "boards.h"
+#include "lib_aci.h"
+#include "aci_setup.h"
+#include "utils.h"
+
+#include "blue_cap_peripheral.h"
+
+#define BATTERY_LEVEL_MICROVOLTS_PER_UNIT   3520
+
+bool BlueCapPeripheral::setCommandQueue(BlueCapCommandEntry* queue, uint8_t size) {
+  if ((queue == NULL) != (size == 0)) {
+    COMMAND_ERROR_LOG(F("setCommandQueue: queue and size must both be set"));
+    return false;
+  }
+  if (commandQueueCount > 0) {
+    COMMAND_ERROR_LOG(F("setCommandQueue: commands are queued"));
+    return false;
+  }
+  commandQueue = queue;
+  commandQueueSize = size;
+  commandQueueHead = 0;
+  return true;
+}
+
+bool BlueCapPeripheral::queueSetData(uint8_t pipe, uint8_t* value, uint8_t size) {
+  return queueCommand(ACI_CMD_SET_LOCAL_DATA, pipe, value, size);
+}
+
+bool BlueCapPeripheral::queueSetTxPower(aci_device_output_power_t txPower) {
+  uint8_t power = txPower;
+  return queueCommand(ACI_CMD_SET_TX_POWER, 0, &power, 1);
+}
+
+bool BlueCapPeripheral::queueGetBatteryLevel() {
+  return queueCommand(ACI_CMD_GET_BATTERY_LEVEL, 0, NULL, 0);
+}
+
+bool BlueCapPeripheral::queueGetTemperature() {
+  return queueCommand(ACI_CMD_GET_TEMPERATURE, 0, NULL, 0);
+}
+
+bool BlueCapPeripheral::queueGetDeviceVersion() {
+  return queueCommand(ACI_CMD_GET_DEVICE_VERSION, 0, NULL, 0);
+}
+
+bool BlueCapPeripheral::queueGetBLEAddress() {
+  return queueCommand(ACI_CMD_GET_DEVICE_ADDRESS, 0, NULL, 0);
+}
+
+uint8_t BlueCapPeripheral::commandQueueDepth() {
+  return commandQueueCount;
+}
+
+// private
+bool BlueCapPeripheral::queueCommand(uint8_t opcode, uint8_t pipe, const uint8_t* data, uint8_t size) {
+  if (commandQueue == NULL) {
+    COMMAND_ERROR_LOG(F("queueCommand: no command queue, call setCommandQueue()"));
+    return false;
+  }
+  if (size > ACI_PIPE_TX_DATA_MAX_LEN) {
+    COMMAND_ERROR_LOG(F("queueCommand: size too large"));
+    return false;
+  }
+  if (commandQueueCount == commandQueueSize) {
+    COMMAND_ERROR_LOG(F("queueCommand: queue full"));
+    return false;
+  }
+  BlueCapCommandEntry* entry = &commandQueue[(commandQueueHead + commandQueueCount) % commandQueueSize];
+  entry->opcode = opcode;
+  entry->pipe = pipe;
+  entry->size = size;
+  if (size > 0) {
+    memcpy(entry->data, data, size);
+  }
+  commandQueueCount++;
+  sendQueuedCommand();
+  return true;
+}
+
+void BlueCapPeripheral::sendQueuedCommand() {
+  if (commandQueueCount == 0 || commandInFlight || !cmdComplete || radioAsleep || !isBondIdle()) {
+    return;
+  }
+  BlueCapCommandEntry* entry = &commandQueue[commandQueueHead];
+  bool status = false;
+  switch (entry->opcode) {
+    case ACI_CMD_SET_LOCAL_DATA:
+      status = lib_aci_set_local_data(&aciState, entry->pipe, entry->data, entry->size);
+      break;
+    case ACI_CMD_SET_TX_POWER:
+      status = lib_aci_set_tx_power((aci_device_output_power_t)entry->data[0]);
+      break;
+    case ACI_CMD_GET_BATTERY_LEVEL:
+      status = lib_aci_get_battery_level();
+      break;
+    case ACI_CMD_GET_TEMPERATURE:
+      status = lib_aci_get_temperature();
+      break;
+    case ACI_CMD_GET_DEVICE_VERSION:
+      status = lib_aci_device_version();
+      break;
+    case ACI_CMD_GET_DEVICE_ADDRESS:
+      status = lib_aci_get_address();
+      break;
+  }
+  TRACE(TRACE_COMMAND, status, entry->pipe, entry->opcode);
+  if (status) {
+    cmdComplete = false;
+    commandInFlight = true;
+    COMMAND_DBUG_LOG(F("sendQueuedCommand:"));
+    COMMAND_DBUG_LOG(entry->opcode, HEX);
+  } else {
+    // the ACI transmit queue is full, leave the entry for the next listen() pass
+    COMMAND_ERROR_LOG(F("sendQueuedCommand: ACI command queue full:"));
+    COMMAND_ERROR_LOG(entry->opcode, HEX);
+  }
+}
+
+bool BlueCapPeripheral::completeQueuedCommand(aci_evt_t* aciEvt) {
+  if (!commandInFlight) {
+    return false;
+  }
+  BlueCapCommandEntry* entry = &commandQueue[commandQueueHead];
+  if (aciEvt != NULL && entry->opcode != aciEvt->params.cmd_rsp.cmd_opcode) {
+    return false;
+  }
+  bool success = aciEvt != NULL && ACI_STATUS_SUCCESS == aciEvt->params.cmd_rsp.cmd_status;
+  uint8_t opcode = entry->opcode;
+  uint8_t pipe = entry->pipe;
+  commandQueueHead = (commandQueueHead + 1) % commandQueueSize;
+  commandQueueCount--;
+  commandInFlight = false;
+  if (isBondIdle()) {
+    cmdComplete = true;
+  }
+  completeBroadcastPush(success);
+  switch (opcode) {
+    case ACI_CMD_SET_LOCAL_DATA:
+      didSetData(pipe, success);
+      break;
+    case ACI_CMD_SET_TX_POWER:
+      didSetTxPower(success);
+      break;
+    case ACI_CMD_GET_BATTERY_LEVEL: {
+      uint16_t millivolts = 0;
+      if (success) {
+        millivolts = (uint32_t)aciEvt->params.cmd_rsp.params.get_battery_level.battery_level * BATTERY_LEVEL_MICROVOLTS_PER_UNIT / 1000;
+      }
+      didGetBatteryLevel(success, millivolts);
+      break;
+    }
+    case ACI_CMD_GET_TEMPERATURE:
+      didGetTemperature(success, success ? aciEvt->params.cmd_rsp.params.get_temperature.temperature_value : 0);
+      break;
+    case ACI_CMD_GET_DEVICE_VERSION:
+      if (success) {
+        aci_evt_cmd_rsp_params_get_device_version_t* version = &aciEvt->params.cmd_rsp.params.get_device_version;
+        didGetDeviceVersion(true, version->configuration_id, version->aci_version, version->setup_id);
+      } else {
+        didGetDeviceVersion(false, 0, 0, 0);
+      }
+      break;
+    case ACI_CMD_GET_DEVICE_ADDRESS:
+      didGetBLEAddress(success, success ? aciEvt->params.cmd_rsp.params.get_device_address.bd_addr_own : NULL);
+      break;
+  }
+  return true;
+}
+
+void BlueCapPeripheral::failQueuedCommand() {
+  if (commandInFlight) {
+    completeQueuedCommand(NULL);
+  }
+}
@@ -0,0 +1,94 @@
+#if !defined(ARDUINO)
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "blue_cap_bond_store.h"
+
+BlueCapFileStore::BlueCapFileStore() {
+  data = NULL;
+  dataSize = 0;
+  fd = -1;
+}
+
+BlueCapFileStore::~BlueCapFileStore() {
+  close();
+}
+
+bool BlueCapFileStore::open(const char* path, uint16_t size) {
+  close();
+  fd = ::open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  off_t fileSize = lseek(fd, 0, SEEK_END);
+  if (fileSize < 0 || (fileSize < size && ftruncate(fd, size) != 0)) {
+    close();
+    return false;
+  }
+  void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    close();
+    return false;
+  }
+  data = (uint8_t*)mapping;
+  dataSize = size;
+  if (fileSize < size) {
+    memset(data + fileSize, 0xFF, size - fileSize);
+  }
+  return true;
+}
+
+void BlueCapFileStore::close() {
+  if (data != NULL) {
+    msync(data, dataSize, MS_SYNC);
+    munmap(data, dataSize);
+    data = NULL;
+    dataSize = 0;
+  }
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+uint8_t BlueCapFileStore::read(uint16_t addr) {
+  return addr < dataSize ? data[addr] : 0xFF;
+}
+
+void BlueCapFileStore::write(uint16_t addr, uint8_t value) {
+  if (addr < dataSize && data[addr] != value) {
+    data[addr] = value;
+    written++;
+  }
+}
+
+void BlueCapFileStore::readBlock(uint16_t addr, uint8_t* buffer, uint16_t size) {
+  if (addr + size > dataSize) {
+    memset(buffer, 0xFF, size);
+    return;
+  }
+  memcpy(buffer, data + addr, size);
+}
+
+void BlueCapFileStore::writeBlock(uint16_t addr, const uint8_t* buffer, uint16_t size) {
+  if (addr + size > dataSize) {
+    return;
+  }
+  for (uint16_t i = 0; i < size; i++) {
+    if (data[addr + i] != buffer[i]) {
+      data[addr + i] = buffer[i];
+      written++;
+    }
+  }
+}
+
+void BlueCapFileStore::flush() {
+  if (data != NULL) {
+    msync(data, dataSize, MS_SYNC);
+  }
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef _BLUE_CAP_LOG_H
+#define _BLUE_CAP_LOG_H
+
+#define LOG_LEVEL_OFF                     0
+#define LOG_LEVEL_ERROR                   1
+#define LOG_LEVEL_DEBUG                   2
+
+#ifndef EVENT_LOG_LEVEL
+#define EVENT_LOG_LEVEL                   LOG_LEVEL_DEBUG
+#endif
+
+#ifndef CREDIT_LOG_LEVEL
+#define CREDIT_LOG_LEVEL                  LOG_LEVEL_DEBUG
+#endif
+
+#ifndef BOND_LOG_LEVEL
+#define BOND_LOG_LEVEL                    LOG_LEVEL_DEBUG
+#endif
+
+#ifndef COMMAND_LOG_LEVEL
+#define COMMAND_LOG_LEVEL                 LOG_LEVEL_DEBUG
+#endif
+
+#ifndef STREAM_LOG_LEVEL
+#define STREAM_LOG_LEVEL                  LOG_LEVEL_DEBUG
+#endif
+
+#if EVENT_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define EVENT_DBUG_LOG(...)               DBUG_LOG(__VA_ARGS__)
+#else
+#define EVENT_DBUG_LOG(...)
+#endif
+#if EVENT_LOG_LEVEL >= LOG_LEVEL_ERROR
+#define EVENT_ERROR_LOG(...)              ERROR_LOG(__VA_ARGS__)
+#else
+#define EVENT_ERROR_LOG(...)
+#endif
+
+#if CREDIT_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define CREDIT_DBUG_LOG(...)              DBUG_LOG(__VA_ARGS__)
+#else
+#define CREDIT_DBUG_LOG(...)
+#endif
+#if CREDIT_LOG_LEVEL >= LOG_LEVEL_ERROR
+#define CREDIT_ERROR_LOG(...)             ERROR_LOG(__VA_ARGS__)
+#else
+#define CREDIT_ERROR_LOG(...)
+#endif
+
+#if BOND_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define BOND_DBUG_LOG(...)                DBUG_LOG(__VA_ARGS__)
+#else
+#define BOND_DBUG_LOG(...)
+#endif
+#if BOND_LOG_LEVEL >= LOG_LEVEL_ERROR
+#define BOND_ERROR_LOG(...)               ERROR_LOG(__VA_ARGS__)
+#else
+#define BOND_ERROR_LOG(...)
+#endif
+
+#if COMMAND_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define COMMAND_DBUG_LOG(...)             DBUG_LOG(__VA_ARGS__)
+#else
+#define COMMAND_DBUG_LOG(...)
+#endif
+#if COMMAND_LOG_LEVEL >= LOG_LEVEL_ERROR
+#define COMMAND_ERROR_LOG(...)            ERROR_LOG(__VA_ARGS__)
+#else
+#define COMMAND_ERROR_LOG(...)
+#endif
+
+#if STREAM_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define STREAM_DBUG_LOG(...)              DBUG_LOG(__VA_ARGS__)
+#else
+#define STREAM_DBUG_LOG(...)
+#endif
+#if STREAM_LOG_LEVEL >= LOG_LEVEL_ERROR
+#define STREAM_ERROR_LOG(...)             ERROR_LOG(__VA_ARGS__)
+#else
+#define STREAM_ERROR_LOG(...)
+#endif
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED                     0
+#endif
+
+#define TRACE_EVENT                       0x01
+#define TRACE_CREDIT                      0x02
+#define TRACE_SEND                        0x03
+#define TRACE_COMMAND                     0x04
+#define TRACE_BOND                        0x05
+#define TRACE_RECOVERY                    0x06
+
+#define TRACE_DUMP_MAGIC                  0xBC
+
+#if TRACE_ENABLED
+#define TRACE(ID, OPCODE, PIPE, VALUE)    trace(ID, OPCODE, PIPE, VALUE)
+#else
+#define TRACE(ID, OPCODE, PIPE, VALUE)
+#endif
+
+struct BlueCapTraceRecord {
+  uint8_t               id;
+  uint8_t               opcode;
+  uint8_t               pipe;
+  uint8_t               value;
+  uint32_t              timestamp;
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef _BLUE_CAP_METRICS_H
+#define _BLUE_CAP_METRICS_H
+
+#ifndef METRICS_ENABLED
+#define METRICS_ENABLED                   0
+#endif
+
+// The caller allocates BlueCapMetrics, so its size is fixed rather than
+// configurable per sketch. Per-pipe counters are a separate caller array
+// sized to the sketch's pipes.
+#define LATENCY_BUCKETS                   20
+
+#define METRICS_EVENT_TYPES               16
+
+// Latency bucket b counts waits of [2^(b-1), 2^b) microseconds, the
+// last bucket everything longer.
+struct BlueCapLatencyHistogram {
+  uint16_t              buckets[LATENCY_BUCKETS];
+};
+
+struct BlueCapPipeMetrics {
+  uint32_t              txBytes;
+  uint32_t              rxBytes;
+  uint16_t              txPackets;
+  uint16_t              rxPackets;
+};
+
+struct BlueCapMetrics {
+  uint16_t                  events[METRICS_EVENT_TYPES];
+  uint16_t                  creditRefills;
+  uint16_t                  sendFailures;
+  // pipes without an entry in the caller's pipe array
+  BlueCapPipeMetrics        otherPipes;
+  BlueCapLatencyHistogram   creditWait;
+  BlueCapLatencyHistogram   ackWait;
+  BlueCapLatencyHistogram   cmdWait;
+};
+
+#if METRICS_ENABLED
+#define METRICS_COUNT(COUNTER)              do {if (metricsData != NULL) {metricsData->COUNTER++;}} while (0)
+#define METRICS_EVENT(OPCODE)               do {if (metricsData != NULL) {metricsData->events[(OPCODE) % METRICS_EVENT_TYPES]++;}} while (0)
+#define METRICS_PIPE(DIRECTION, PIPE, SIZE) recordPipe(DIRECTION, PIPE, SIZE)
+#define METRICS_TIMER(START)                uint32_t START = metricsData != NULL ? micros() : 0
+#define METRICS_LATENCY(HISTOGRAM, START)   do {if (metricsData != NULL) {recordLatency(&metricsData->HISTOGRAM, START);}} while (0)
+#else
+#define METRICS_COUNT(COUNTER)
+#define METRICS_EVENT(OPCODE)
+#define METRICS_PIPE(DIRECTION, PIPE, SIZE)
+#define METRICS_TIMER(START)
+#define METRICS_LATENCY(HISTOGRAM, START)
+#endif
+
+#endif
@@ -12,92 +12,152 @@
 #define BOND_TIMEOUT_SECONDS                          180
 #define BOND_ADVERTISING_INTERVAL_MILISECONDS         0x0050
 
-#define BROADCAST_TIMEOUT_SECONDS                     10
-#define BROADCAST_ADVERTISING_INTERVAL_MILISECONDS    0x0100
+#define RECONNECT_FAST_TIMEOUT_SECONDS                10
+#define RECONNECT_FAST_ADVERTISING_INTERVAL           0x0020
+#define RECONNECT_SLOW_TIMEOUT_SECONDS                30
+#define RECONNECT_SLOW_ADVERTISING_INTERVAL           0x0320
 
-#define REMOTE_COMMAND(X, Y, Z)                                 \
+#define STARTUP_TIMEOUT_MILLISECONDS                  200
+#define STARTUP_PROBE_TIMEOUT_MILLISECONDS            50
+
+// how long to wait for DEVICE_STARTED before probing a radio whose setup
+// fingerprint is stored, a configured radio sends none
+#ifndef STARTUP_PROBE_WAIT_MILLISECONDS
+#define STARTUP_PROBE_WAIT_MILLISECONDS               5
+#endif
+
+#define REMOTE_COMMAND(X, Y, Z, SIZE)                           \
   bool BlueCapPeripheral::X {                                   \
     bool status = false;                                        \
     if (isPipeAvailable(pipe)) {                                \
       waitForCredit();                                          \
       status = Y;                                               \
     }                                                           \
+    TRACE(TRACE_SEND, status, pipe, 0);                         \
     if (status) {                                               \
-      waitForAck();                                             \
-      DBUG_LOG(F(Z));                                           \
-      DBUG_LOG(F("successful over pipe:"));                     \
-      DBUG_LOG(pipe, HEX);                                      \
+      lastActivityAt = millis();                                \
+      METRICS_PIPE(true, pipe, SIZE);                           \
+      decrementCredit();                                        \
+      if (stopAndWait) {                                        \
+        waitForAck();                                           \
+      }                                                         \
+      COMMAND_DBUG_LOG(F(Z));                                   \
+      COMMAND_DBUG_LOG(F("successful over pipe:"));             \
+      COMMAND_DBUG_LOG(pipe, HEX);                              \
     } else {                                                    \
-      ERROR_LOG(F(Z));                                          \
-      ERROR_LOG(F("failed over pipe:"));                        \
-      ERROR_LOG(pipe, HEX);                                     \
+      METRICS_COUNT(sendFailures);                              \
+      COMMAND_ERROR_LOG(F(Z));                                  \
+      COMMAND_ERROR_LOG(F("failed over pipe:"));                \
+      COMMAND_ERROR_LOG(pipe, HEX);                             \
     }                                                           \
     return status;                                              \
   }
 
 #define LOCAL_COMMAND(X, Y, Z)                                  \
   bool BlueCapPeripheral::X {                                   \
+    waitForWakeup();                                            \
     waitForCmdComplete();                                       \
     cmdComplete = false;                                        \
     bool status = Y;                                            \
+    TRACE(TRACE_COMMAND, status, 0, 0);                         \
     if (status) {                                               \
-      DBUG_LOG(F(Z));                                           \
-      DBUG_LOG(F("successful"));                                \
+      COMMAND_DBUG_LOG(F(Z));                                   \
+      COMMAND_DBUG_LOG(F("successful"));                        \
     } else {                                                    \
-      ERROR_LOG(F(Z));                                          \
-      ERROR_LOG(F("failed"));                                   \
+      COMMAND_ERROR_LOG(F(Z));                                  \
+      COMMAND_ERROR_LOG(F("failed"));                           \
       cmdComplete = true;                                       \
     }                                                           \
     return status;                                              \
   }
 
+BlueCapPeripheral* BlueCapPeripheral::interruptPeripheral = NULL;
+
 // public methods
 BlueCapPeripheral::BlueCapPeripheral(uint8_t _reqnPin, uint8_t _rdynPin) {
-	init(_reqnPin, _rdynPin, 0, 0, false);
+	init(_reqnPin, _rdynPin, 0, NULL, NULL);
 }
 
-BlueCapPeripheral::BlueCapPeripheral(uint8_t _reqnPin, uint8_t _rdynPin, uint16_t _eepromOffset) {
-  init(_reqnPin, _rdynPin, _eepromOffset, 0, false);
+BlueCapPeripheral::BlueCapPeripheral(uint8_t _reqnPin, uint8_t _rdynPin, uint16_t _eepromOffset, BondingState* _bonding) {
+  init(_reqnPin, _rdynPin, _eepromOffset, _bonding, NULL);
 }
 
-BlueCapPeripheral::BlueCapPeripheral(uint8_t _reqnPin, uint8_t _rdynPin, uint16_t _eepromOffset, uint8_t _maxBonds) {
-  init(_reqnPin, _rdynPin, _eepromOffset, _maxBonds, false);
+BlueCapPeripheral::BlueCapPeripheral(uint8_t _reqnPin, uint8_t _rdynPin, BroadcastingState* _broadcasting) {
+  init(_reqnPin, _rdynPin, 0, NULL, _broadcasting);
 }
 
-BlueCapPeripheral::~BlueCapPeripheral() {
-  if (maxBonds > 0) {
-    delete[] bonds;
+void BlueCapPeripheral::loop() {
+  if (drainEvents(drainMaxEvents, drainBudgetMicros) == 0) {
+    managePower();
   }
 }
 
 void  BlueCapPeripheral::clearBondData() {
-  for(int i = 0; i < maxBonds; i++) {
-    bonds[i].clearBondData();
+  for(int i = 0; bondingEnabled() && i < bonding->maxBonds; i++) {
+    bonding->bonds[i].clearBondData(this);
   }
 }
 
 bool BlueCapPeripheral::addBond() {
   bool result = false;
   if (numberOfNewBonds() == 0) {
-    uint8_t bondedCount = numberOfBondedDevices();
-    if (bondedCount < maxBonds) {
+    uint8_t index = nextBondIndex(0, false);
+    if (index != NO_BOND_INDEX) {
       result = true;
-      bonds[bondedCount].newBond = true;
-      DBUG_LOG(F("addBond, index:"));
-      DBUG_LOG(bondedCount);
+      setBondState(index, false, true);
+      BOND_DBUG_LOG(F("addBond, index:"));
+      BOND_DBUG_LOG(index);
     } else {
-      ERROR_LOG(F("No more bonds"));
+      BOND_ERROR_LOG(F("No more bonds"));
     }
   } else {
-    ERROR_LOG(F("New bond exists. only one new bond at a time"));
+    BOND_ERROR_LOG(F("New bond exists. only one new bond at a time"));
   }
   return result;
 }
 
-REMOTE_COMMAND(sendAck(uint8_t pipe), lib_aci_send_ack(&aciState, pipe), "sendAck")
-REMOTE_COMMAND(sendNack(uint8_t pipe, const uint8_t errorCode), lib_aci_send_nack(&aciState, pipe, errorCode), "sendNack")
-REMOTE_COMMAND(sendData(uint8_t pipe, uint8_t* value, uint8_t size), lib_aci_send_data(pipe, value, size), "sendData")
-REMOTE_COMMAND(requestData(uint8_t pipe), lib_aci_request_data(&aciState, pipe), "requestData")
+uint8_t BlueCapPeripheral::bondCount() {
+  return bondingEnabled() ? bonding->bondedCount : 0;
+}
+
+uint8_t BlueCapPeripheral::freeBondSlots() {
+  return bondingEnabled() ? bonding->maxBonds - bonding->activeBondCount : 0;
+}
+
+bool BlueCapPeripheral::isBonded(uint8_t index) {
+  return bondingEnabled() && index < bonding->maxBonds && (bonding->bondedMask[index >> 3] & (1 << (index & 0x07)));
+}
+
+uint32_t BlueCapPeripheral::reconnectLatency(uint8_t index) {
+  return bondingEnabled() && index < bonding->maxBonds ? bonding->reconnectLatencies[index] : 0;
+}
+
+void BlueCapPeripheral::setReconnectWindows(uint16_t fastSeconds, uint16_t fastInterval, uint16_t slowSeconds, uint16_t slowInterval) {
+  if (!bondingEnabled()) {
+    return;
+  }
+  bonding->fastAdvertisingSeconds = fastSeconds;
+  bonding->fastAdvertisingInterval = fastInterval;
+  bonding->slowAdvertisingSeconds = slowSeconds;
+  bonding->slowAdvertisingInterval = slowInterval;
+}
+
+uint8_t BlueCapPeripheral::nextBondedIndex(uint8_t fromIndex) {
+  for (uint16_t i = fromIndex; bondingEnabled() && i < bonding->maxBonds; i++) {
+    uint8_t bits = bonding->bondedMask[i >> 3] >> (i & 0x07);
+    if (bits == 0) {
+      i |= 0x07;
+    } else if (bits & 0x01) {
+      return i;
+    }
+  }
+  return NO_BOND_INDEX;
+}
+
+REMOTE_COMMAND(sendAck(uint8_t pipe), lib_aci_send_ack(&aciState, pipe), "sendAck", 0)
+REMOTE_COMMAND(sendNack(uint8_t pipe, const uint8_t errorCode), lib_aci_send_nack(&aciState, pipe, errorCode), "sendNack", 0)
+REMOTE_COMMAND(sendData(uint8_t pipe, uint8_t* value, uint8_t size), lib_aci_send_data(pipe, value, size), "sendData", size)
+REMOTE_COMMAND(requestData(uint8_t pipe), lib_aci_request_data(&aciState, pipe), "requestData", 0)
 
 LOCAL_COMMAND(setData(uint8_t pipe, uint8_t* value, uint8_t size), lib_aci_set_local_data(&aciState, pipe, value, size), "setData")
 LOCAL_COMMAND(setTxPower(aci_device_output_power_t txPower), lib_aci_set_tx_power(txPower), "setTxPower")
@@ -106,10 +166,261 @@ LOCAL_COMMAND(getTemperature(), lib_aci_get_temperature(), "getTemperartue")
 LOCAL_COMMAND(getDeviceVersion(), lib_aci_device_version(), "getDeviceVersion")
 LOCAL_COMMAND(getBLEAddress(), lib_aci_get_address(), "getBLEAddress")
 LOCAL_COMMAND(connect(), lib_aci_connect(CONNECT_TIMEOUT_SECONDS, CONNECT_ADVERTISING_INTERVAL_MILISECONDS), "connect")
+LOCAL_COMMAND(connect(uint16_t timeout, uint16_t interval), lib_aci_connect(timeout, interval), "connect")
 LOCAL_COMMAND(bond(), lib_aci_bond(BOND_TIMEOUT_SECONDS, BOND_ADVERTISING_INTERVAL_MILISECONDS), "bond")
-LOCAL_COMMAND(broadcast(), lib_aci_broadcast(BROADCAST_TIMEOUT_SECONDS, BROADCAST_ADVERTISING_INTERVAL_MILISECONDS), "broadcast")
+LOCAL_COMMAND(broadcast(), broadcastEnabled() ? lib_aci_broadcast(broadcasting->seconds, broadcasting->interval) :
+                                               lib_aci_broadcast(BROADCAST_TIMEOUT_SECONDS, BROADCAST_ADVERTISING_INTERVAL_MILISECONDS), "broadcast")
+LOCAL_COMMAND(broadcast(uint16_t timeout, uint16_t interval), lib_aci_broadcast(timeout, interval), "broadcast")
+LOCAL_COMMAND(changeTiming(uint16_t minInterval, uint16_t maxInterval, uint16_t latency, uint16_t timeout), lib_aci_change_timing(minInterval, maxInterval, latency, timeout), "changeTiming")
 LOCAL_COMMAND(radioReset(), lib_aci_radio_reset(), "radioReset")
-LOCAL_COMMAND(sleep(), lib_aci_sleep(), "sleep")
+
+void BlueCapPeripheral::setStopAndWait(bool enabled) {
+  stopAndWait = enabled;
+}
+
+uint8_t BlueCapPeripheral::packetsInFlight() {
+  return aciState.data_credit_total - aciState.data_credit_available;
+}
+
+uint32_t BlueCapPeripheral::bondBytesWritten() {
+  return bondStore != NULL ? bondStore->bytesWritten() : 0;
+}
+
+void BlueCapPeripheral::setBondStore(BlueCapBondStore* store) {
+  bondStore = store;
+  for (int i = 0; bondingEnabled() && i < bonding->maxBonds; i++) {
+    bonding->bonds[i].readBondDirectory(this);
+  }
+}
+
+bool BlueCapPeripheral::setTransmitQueue(BlueCapTxPacket* queue, uint8_t size) {
+  if ((queue == NULL) != (size == 0)) {
+    COMMAND_ERROR_LOG(F("setTransmitQueue: queue and size must both be set"));
+    return false;
+  }
+  clearTxQueue();
+  txQueue = queue;
+  txQueueSize = size;
+  txQueueHead = 0;
+  return true;
+}
+
+bool BlueCapPeripheral::enqueueData(uint8_t pipe, uint8_t* value, uint8_t size) {
+  if (txQueue == NULL) {
+    COMMAND_ERROR_LOG(F("enqueueData: no transmit queue, call setTransmitQueue()"));
+    return false;
+  }
+  if (size > ACI_PIPE_TX_DATA_MAX_LEN) {
+    COMMAND_ERROR_LOG(F("enqueueData: size too large"));
+    return false;
+  }
+  if (isLatestValue(pipe)) {
+    for (uint8_t i = 0; i < txQueueCount; i++) {
+      BlueCapTxPacket* packet = &txQueue[(txQueueHead + i) % txQueueSize];
+      if (packet->pipe == pipe) {
+        packet->size = size;
+        memcpy(packet->data, value, size);
+        coalescedCount++;
+        return true;
+      }
+    }
+  }
+  if (txQueueCount == txQueueSize) {
+    COMMAND_ERROR_LOG(F("enqueueData: queue full"));
+    return false;
+  }
+  if (!isPipeAvailable(pipe)) {
+    return false;
+  }
+  BlueCapTxPacket* packet = &txQueue[(txQueueHead + txQueueCount) % txQueueSize];
+  packet->pipe = pipe;
+  packet->size = size;
+  memcpy(packet->data, value, size);
+  txQueueCount++;
+  sendQueuedData();
+  return true;
+}
+
+bool BlueCapPeripheral::setInterruptMode(uint8_t _interruptNumber, hal_aci_evt_t* queue, uint8_t size) {
+  if (queue == NULL || size == 0 || size > 128 || (size & (size - 1)) != 0) {
+    EVENT_ERROR_LOG(F("setInterruptMode: queue size must be a power of two up to 128"));
+    return false;
+  }
+  eventQueue = queue;
+  eventQueueSize = size;
+  interruptMode = true;
+  interruptNumber = _interruptNumber;
+  return true;
+}
+
+uint8_t BlueCapPeripheral::eventQueueDepth() {
+  return eventQueueHead - eventQueueTail;
+}
+
+uint8_t BlueCapPeripheral::eventQueueHighWaterMark() {
+  return eventQueueHighWater;
+}
+
+uint16_t BlueCapPeripheral::eventQueueOverflowCount() {
+  noInterrupts();
+  uint16_t count = eventQueueOverflows;
+  interrupts();
+  return count;
+}
+
+bool BlueCapPeripheral::setMetrics(BlueCapMetrics* _metrics, BlueCapPipeMetrics* pipes, uint8_t pipeCount) {
+  if ((pipes == NULL) != (pipeCount == 0)) {
+    EVENT_ERROR_LOG(F("setMetrics: pipes and pipeCount must both be set"));
+    return false;
+  }
+  metricsData = _metrics;
+  pipeMetrics = pipes;
+  pipeMetricsCount = pipeCount;
+  resetMetrics();
+  return METRICS_ENABLED || _metrics == NULL;
+}
+
+const BlueCapMetrics* BlueCapPeripheral::metrics() {
+  return metricsData;
+}
+
+void BlueCapPeripheral::resetMetrics() {
+  if (metricsData != NULL) {
+    memset(metricsData, 0, sizeof(BlueCapMetrics));
+  }
+  if (pipeMetrics != NULL) {
+    memset(pipeMetrics, 0, pipeMetricsCount*sizeof(BlueCapPipeMetrics));
+  }
+}
+
+uint8_t BlueCapPeripheral::drainEvents(uint8_t maxEvents, uint32_t budgetMicros) {
+  uint32_t start = micros();
+  uint8_t count = 0;
+  while (count < maxEvents && listen()) {
+    count++;
+    if (budgetMicros > 0 && micros() - start >= budgetMicros) {
+      break;
+    }
+  }
+  return count;
+}
+
+void BlueCapPeripheral::setDrainBudget(uint8_t maxEvents, uint32_t budgetMicros) {
+  drainMaxEvents = maxEvents;
+  drainBudgetMicros = budgetMicros;
+}
+
+bool BlueCapPeripheral::hasEventBacklog() {
+  if (interruptMode) {
+    return eventQueueHead != eventQueueTail || eventQueueStalled;
+  }
+  hal_aci_evt_t event;
+  return lib_aci_event_peek(&event) || digitalRead(rdynPin) == LOW;
+}
+
+uint8_t BlueCapPeripheral::traceDepth() {
+  return traceCount;
+}
+
+bool BlueCapPeripheral::setTraceBuffer(BlueCapTraceRecord* buffer, uint8_t size) {
+  if ((buffer == NULL) != (size == 0)) {
+    EVENT_ERROR_LOG(F("setTraceBuffer: buffer and size must both be set"));
+    return false;
+  }
+  traceBuffer = buffer;
+  traceSize = size;
+  traceHead = 0;
+  traceCount = 0;
+  return TRACE_ENABLED || buffer == NULL;
+}
+
+void BlueCapPeripheral::dumpTrace(Print& out) {
+  out.write(TRACE_DUMP_MAGIC);
+  out.write(traceCount);
+  uint8_t index = (traceHead + traceSize - traceCount) % (traceSize > 0 ? traceSize : 1);
+  for (uint8_t i = 0; i < traceCount; i++) {
+    BlueCapTraceRecord* record = &traceBuffer[index];
+    out.write(record->id);
+    out.write(record->opcode);
+    out.write(record->pipe);
+    out.write(record->value);
+    for (uint8_t j = 0; j < 4; j++) {
+      out.write((uint8_t)(record->timestamp >> (8*j)));
+    }
+    index = (index + 1) % traceSize;
+  }
+  traceCount = 0;
+}
+
+bool BlueCapPeripheral::setReceiveQueue(BlueCapRxPacket* queue, uint8_t size) {
+  if ((queue == NULL) != (size == 0)) {
+    EVENT_ERROR_LOG(F("setReceiveQueue: queue and size must both be set"));
+    return false;
+  }
+  rxQueue = queue;
+  rxQueueSize = size;
+  rxQueueHead = 0;
+  rxQueueCount = 0;
+  return true;
+}
+
+uint8_t* BlueCapPeripheral::peekData(uint8_t* pipe, uint8_t* size) {
+  if (rxQueueCount > 0) {
+    BlueCapRxPacket* packet = &rxQueue[rxQueueHead];
+    *pipe = packet->pipe;
+    *size = packet->size;
+    return packet->data;
+  }
+  return NULL;
+}
+
+void BlueCapPeripheral::releaseData() {
+  if (rxQueueCount > 0) {
+    rxQueueHead = (rxQueueHead + 1) % rxQueueSize;
+    rxQueueCount--;
+  }
+}
+
+uint8_t BlueCapPeripheral::rxQueueDepth() {
+  return rxQueueCount;
+}
+
+uint16_t BlueCapPeripheral::rxQueueDropCount() {
+  return rxQueueDrops;
+}
+
+void BlueCapPeripheral::setLatestValue(uint8_t pipe, bool enabled) {
+  if (pipe >= 8*PIPES_ARRAY_SIZE) {
+    return;
+  }
+  if (enabled) {
+    latestValuePipes[pipe >> 3] |= 1 << (pipe & 0x07);
+  } else {
+    latestValuePipes[pipe >> 3] &= ~(1 << (pipe & 0x07));
+  }
+}
+
+bool BlueCapPeripheral::isLatestValue(uint8_t pipe) {
+  return pipe < 8*PIPES_ARRAY_SIZE && (latestValuePipes[pipe >> 3] & (1 << (pipe & 0x07)));
+}
+
+uint16_t BlueCapPeripheral::coalescedUpdates() {
+  return coalescedCount;
+}
+
+uint8_t BlueCapPeripheral::txQueueDepth() {
+  return txQueueCount;
+}
+
+uint8_t BlueCapPeripheral::txQueueDepth(uint8_t pipe) {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < txQueueCount; i++) {
+    if (txQueue[(txQueueHead + i) % txQueueSize].pipe == pipe) {
+      count++;
+    }
+  }
+  return count;
+}
 
 // protected
 void BlueCapPeripheral::setServicePipeTypeMapping(services_pipe_type_mapping_t* mapping, int count) {
@@ -117,124 +428,222 @@ void BlueCapPeripheral::setServicePipeTypeMapping(services_pipe_type_mapping_t*
 	numberOfPipes = count;
 }
 
+bool BlueCapPeripheral::setPipeHandlers(PipeHandler* table, uint8_t size) {
+  if ((table == NULL) != (size == 0)) {
+    COMMAND_ERROR_LOG(F("setPipeHandlers: table and size must both be set"));
+    return false;
+  }
+  pipeHandlers = table;
+  pipeHandlerCount = size;
+  if (table != NULL) {
+    memset(table, 0, size*sizeof(PipeHandler));
+  }
+  return true;
+}
+
+bool BlueCapPeripheral::setPipeHandler(uint8_t pipe, BlueCapPipeHandler handler, uint8_t expectedSize) {
+  if (pipe == 0 || pipe > numberOfPipes) {
+    COMMAND_ERROR_LOG(F("setPipeHandler: pipe not in service pipe mapping:"));
+    COMMAND_ERROR_LOG(pipe, HEX);
+    return false;
+  }
+  if (pipe >= pipeHandlerCount) {
+    COMMAND_ERROR_LOG(F("setPipeHandler: pipe outside handler table, call setPipeHandlers()"));
+    return false;
+  }
+  pipeHandlers[pipe].handler = handler;
+  pipeHandlers[pipe].expectedSize = expectedSize;
+  return true;
+}
+
 void BlueCapPeripheral::setSetUpMessages(hal_aci_data_t* messages, int count) {
 	setUpMessages = messages;
 	numberOfSetupMessages = count;
 }
 
 bool BlueCapPeripheral::isPipeAvailable(uint8_t pipe) {
-	bool status = lib_aci_is_pipe_available(&aciState, pipe);
-	if (status) {
-		DBUG_LOG(F("Pipe available:"));
-    DBUG_LOG(pipe, HEX);
-	} else {
-		ERROR_LOG(F("Pipe unavailable:"));
-    ERROR_LOG(pipe, HEX);
+	bool status = pipe < 8*PIPES_ARRAY_SIZE && (pipesOpen[pipe >> 3] & (1 << (pipe & 0x07)));
+	if (!status) {
+		COMMAND_ERROR_LOG(F("Pipe unavailable:"));
+    COMMAND_ERROR_LOG(pipe, HEX);
 	}
 	return status;
 }
 
 // private methods
-void BlueCapPeripheral::init(uint8_t _reqnPin, uint8_t _rdynPin, uint16_t _eepromOffset, uint8_t _maxBonds, bool _broacasting) {
+void BlueCapPeripheral::init(uint8_t _reqnPin, uint8_t _rdynPin, uint16_t _eepromOffset, BondingState* _bonding, BroadcastingState* _broadcasting) {
 	setUpMessages = NULL;
 	numberOfSetupMessages = 0;
 	servicesPipeTypeMapping = NULL;
 	numberOfPipes = 0;
+  pipeHandlers = NULL;
+  pipeHandlerCount = 0;
+  memset(pipesOpen, 0, sizeof(pipesOpen));
 	isConnected = false;
 	ack = false;
 	timingChangeDone = false;
-  broadcasting = _broacasting;
+  broadcasting = _broadcasting;
 	cmdComplete = true;
-  currentBondIndex = 0;
+  stopAndWait = false;
+  txQueue = NULL;
+  txQueueSize = 0;
+  txQueueHead = 0;
+  txQueueCount = 0;
+  coalescedCount = 0;
+  memset(latestValuePipes, 0, sizeof(latestValuePipes));
+  commandQueue = NULL;
+  commandQueueSize = 0;
+  commandQueueHead = 0;
+  commandQueueCount = 0;
+  commandInFlight = false;
+  rxQueue = NULL;
+  rxQueueSize = 0;
+  rxQueueHead = 0;
+  rxQueueCount = 0;
+  rxQueueDrops = 0;
+  initStreams();
+  initTiming();
+  initBroadcast();
+  initPower();
+  initRecovery();
+  interruptMode = false;
+  eventQueue = NULL;
+  eventQueueSize = 0;
+  fingerprintAddress = NO_FINGERPRINT_ADDRESS;
+  startupProbe = false;
+  startupProbeSucceeded = false;
+  deviceStarted = false;
+  startupAt = 0;
+  startupDuration = 0;
+  drainMaxEvents = 1;
+  drainBudgetMicros = 0;
+  interruptNumber = 1;
+  eventQueueHead = 0;
+  eventQueueTail = 0;
+  eventQueueHighWater = 0;
+  eventQueueOverflows = 0;
+  eventQueueStalled = false;
+  traceBuffer = NULL;
+  traceSize = 0;
+  traceHead = 0;
+  traceCount = 0;
+  metricsData = NULL;
+  pipeMetrics = NULL;
+  pipeMetricsCount = 0;
+#if defined(ARDUINO)
+  bondStore = &eepromStore;
+#else
+  // off-device there is no default backend, call setBondStore()
+  bondStore = NULL;
+#endif
   reqnPin = _reqnPin;
   rdynPin = _rdynPin;
-  maxBonds = _maxBonds;
-  if (maxBonds > 0) {
-    bonds = new BlueCapBond[maxBonds];
-    for (int i = 0; i < maxBonds; i++) {
-      bonds[i].init(this, _eepromOffset, _maxBonds, i);
-    }
-  } else {
-    bonds = NULL;
-  }
+  bonding = _bonding;
+  initBonds(_eepromOffset);
 }
 
-void BlueCapPeripheral::listen() {
-	if (lib_aci_event_get(&aciState, &aciData)) {
+bool BlueCapPeripheral::listen() {
+	bool handled = nextEvent(&aciData);
+	if (handled) {
 		aci_evt_t  *aciEvt;
 		aciEvt = &aciData.evt;
+		TRACE(TRACE_EVENT, aciEvt->evt_opcode, aciEvt->params.data_received.rx_data.pipe_number, aciEvt->len);
+		METRICS_EVENT(aciEvt->evt_opcode);
 		switch(aciEvt->evt_opcode) {
 			case ACI_EVT_DEVICE_STARTED:
 				aciState.data_credit_total = aciEvt->params.device_started.credit_available;
-				DBUG_LOG(F("Total credits"));
-				DBUG_LOG(aciState.data_credit_total, DEC);
+				deviceStarted = true;
+				didWakeRadio();
+				failQueuedCommand();
+				EVENT_DBUG_LOG(F("Total credits"));
+				EVENT_DBUG_LOG(aciState.data_credit_total, DEC);
 				switch(aciEvt->params.device_started.device_mode) {
 					case ACI_DEVICE_SETUP:
-						DBUG_LOG(F("ACI_DEVICE_SETUP"));
+						EVENT_DBUG_LOG(F("ACI_DEVICE_SETUP"));
 						if (ACI_STATUS_TRANSACTION_COMPLETE != do_aci_setup(&aciState)) {
-							ERROR_LOG(F("ACI_DEVICE_SETUP failed"));
+							EVENT_ERROR_LOG(F("ACI_DEVICE_SETUP failed"));
+						} else {
+							saveSetupFingerprint();
+							resetBroadcastFrames();
 						}
 						break;
 					case ACI_DEVICE_STANDBY: {
-						DBUG_LOG(F("ACI_DEVICE_STANDBY"));
-            if (maxBonds > 0) {
-              if (bonds[currentBondIndex].restoreIfBonded(&aciState)) {
-                bonds[currentBondIndex].connectOrBond();
-                didStartAdvertising();
-              }
-            } else if (broadcasting) {
-              broadcast();
-              didStartAdvertising();
-              DBUG_LOG(F("Advertising broadcast started"));
-            } else {
-  						connect();
-  						didStartAdvertising();
-  						DBUG_LOG(F("Bonding not configured. Advertising started"));
-            }
+						EVENT_DBUG_LOG(F("ACI_DEVICE_STANDBY"));
+						if (fingerprintAddress != NO_FINGERPRINT_ADDRESS && bondStore != NULL &&
+						    bondStore->read(fingerprintAddress + 2) != aciState.data_credit_total) {
+							saveSetupFingerprint();
+						}
+						startAdvertising();
 						break;
 					}
 				}
 				break;
 
 			case ACI_EVT_CMD_RSP:
-				DBUG_LOG(F("ACI_EVT_CMD_RSP"));
-				DBUG_LOG(aciEvt->params.cmd_rsp.cmd_opcode, HEX);
-        cmdComplete = true;
+				EVENT_DBUG_LOG(F("ACI_EVT_CMD_RSP"));
+				EVENT_DBUG_LOG(aciEvt->params.cmd_rsp.cmd_opcode, HEX);
+        if (!isBondIdle() &&
+            (ACI_CMD_WRITE_DYNAMIC_DATA == aciEvt->params.cmd_rsp.cmd_opcode ||
+             ACI_CMD_READ_DYNAMIC_DATA == aciEvt->params.cmd_rsp.cmd_opcode)) {
+          bonding->bonds[bonding->currentBondIndex].didReceiveCommandResponse(this, &aciState, aciEvt);
+          break;
+        }
+        if (completeQueuedCommand(aciEvt)) {
+          break;
+        }
+        if (startupProbe && ACI_CMD_GET_DEVICE_VERSION == aciEvt->params.cmd_rsp.cmd_opcode) {
+          startupProbe = false;
+          startupProbeSucceeded = ACI_STATUS_SUCCESS == aciEvt->params.cmd_rsp.cmd_status;
+          cmdComplete = true;
+          break;
+        }
+        if (isBondIdle()) {
+          cmdComplete = true;
+        }
 				if (ACI_STATUS_SUCCESS != aciEvt->params.cmd_rsp.cmd_status) {
-					ERROR_LOG(F("ACI_EVT_CMD_RSP: Error. Arduino is in an while(1); loop"));
-          ERROR_LOG(aciEvt->params.cmd_rsp.cmd_status, HEX);
-					while(1){delay(1000);};
+					handleCommandError(aciEvt->params.cmd_rsp.cmd_opcode, aciEvt->params.cmd_rsp.cmd_status);
 				} else {
+          if (ACI_CMD_RADIO_RESET == aciEvt->params.cmd_rsp.cmd_opcode) {
+            didResetRadio();
+          } else if (RECOVERY_RETRYING == recoveryStep && isAdvertisingCommand(aciEvt->params.cmd_rsp.cmd_opcode)) {
+            finishRecovery();
+          }
 					didReceiveCommandResponse(aciEvt->params.cmd_rsp.cmd_opcode, aciEvt->params.data_received.rx_data.aci_data, aciEvt->len - 3);
 				}
 				break;
 
 			case ACI_EVT_CONNECTED:
-				DBUG_LOG(F("ACI_EVT_CONNECTED"));
+				EVENT_DBUG_LOG(F("ACI_EVT_CONNECTED"));
 				isConnected = true;
 				timingChangeDone = false;
 				aciState.data_credit_available = aciState.data_credit_total;
+				resetTiming();
+				updateTiming(aciEvt->params.connected.conn_rf_interval, aciEvt->params.connected.conn_slave_rf_latency, aciEvt->params.connected.conn_rf_timeout);
+				if (bondingEnabled()) {
+				  didReconnectBond();
+				}
 				didConnect();
 				lib_aci_device_version();
 				break;
 
       case ACI_EVT_BOND_STATUS:
         aciState.bonded = aciEvt->params.bond_status.status_code;
-				DBUG_LOG(F("ACI_EVT_BOND_STATUS"));
-				DBUG_LOG(aciState.bonded, HEX);
+				EVENT_DBUG_LOG(F("ACI_EVT_BOND_STATUS"));
+				EVENT_DBUG_LOG(aciState.bonded, HEX);
 				if (aciState.bonded == ACI_BOND_STATUS_SUCCESS) {
-					DBUG_LOG(F("Bond successful"));
-          if (maxBonds > 0) {
-            bonds[currentBondIndex].newBond = false;
+					EVENT_DBUG_LOG(F("Bond successful"));
+          if (bondingEnabled()) {
+            setBondState(bonding->currentBondIndex, isBonded(bonding->currentBondIndex), false);
           }
 					didBond();
 				} else {
-					ERROR_LOG(F("Bond failed"));
+					EVENT_ERROR_LOG(F("Bond failed"));
 				}
         break;
 
 			case ACI_EVT_PIPE_STATUS:
-				DBUG_LOG(F("ACI_EVT_PIPE_STATUS"));
+				EVENT_DBUG_LOG(F("ACI_EVT_PIPE_STATUS"));
+				memcpy(pipesOpen, aciEvt->params.pipe_status.pipes_open_bitmap, sizeof(pipesOpen));
 				didReceivePipeStatusChange();
 				if (doTimingChange() && (timingChangeDone == false)) {
 					lib_aci_change_timing_GAP_PPCP();
@@ -243,31 +652,44 @@ void BlueCapPeripheral::listen() {
 				break;
 
 			case ACI_EVT_TIMING:
-				DBUG_LOG(F("ACI_EVT_TIMING"));
+				EVENT_DBUG_LOG(F("ACI_EVT_TIMING"));
+				updateTiming(aciEvt->params.timing.conn_rf_interval, aciEvt->params.timing.conn_slave_rf_latency, aciEvt->params.timing.conn_rf_timeout);
 				break;
 
 			case ACI_EVT_DISCONNECTED:
 				isConnected = false;
 				ack = true;
-				DBUG_LOG(F("ACI_EVT_DISCONNECTED"));
+				aciState.data_credit_available = aciState.data_credit_total;
+				memset(pipesOpen, 0, sizeof(pipesOpen));
+				clearTxQueue();
+				endStream(false);
+				EVENT_DBUG_LOG(F("ACI_EVT_DISCONNECTED"));
         if (ACI_STATUS_ERROR_ADVT_TIMEOUT == aciEvt->params.disconnected.aci_status) {
           didTimeout();
         } else {
           didDisconnect();
         }
-        if (maxBonds > 0) {
-          if (ACI_STATUS_ERROR_ADVT_TIMEOUT != aciEvt->params.disconnected.aci_status) {
-            bonds[currentBondIndex].writeIfBonded(&aciState, aciEvt);
-          }
-          nextBondIndex();
-          if (bonds[currentBondIndex].restoreIfBonded(&aciState)) {
-            bonds[currentBondIndex].connectOrBond();
-            didStartAdvertising();
+        if (bondingEnabled()) {
+          if (ACI_STATUS_ERROR_ADVT_TIMEOUT == aciEvt->params.disconnected.aci_status) {
+            nextBondIndex();
+            advertiseBond();
+          } else {
+            bonding->disconnectedAt = millis();
+            if (!bonding->bonds[bonding->currentBondIndex].writeIfBonded(this, &aciState, aciEvt)) {
+              startReconnect();
+              advertiseBond();
+            }
           }
-        } else if (!broadcasting) {
+        } else if (ACI_STATUS_ERROR_ADVT_TIMEOUT == aciEvt->params.disconnected.aci_status && sleepRadio()) {
+          EVENT_DBUG_LOG(F("Advertising paused"));
+        } else if (broadcastEnabled()) {
+          broadcast();
+          didStartAdvertising();
+          EVENT_DBUG_LOG(F("Advertising broadcast restarted"));
+        } else {
   				connect();
           didStartAdvertising();
-  				DBUG_LOG(F("Advertising started"));
+  				EVENT_DBUG_LOG(F("Advertising started"));
         }
 				break;
 
@@ -275,34 +697,51 @@ void BlueCapPeripheral::listen() {
 				int pipe = aciEvt->params.data_received.rx_data.pipe_number;
 				int size = aciEvt->len - 2;
 				ack = true;
-				DBUG_LOG(F("ACI_EVT_DATA_RECEIVED Pipe #:"));
-				DBUG_LOG(pipe, HEX);
-				didReceiveData(pipe, aciEvt->params.data_received.rx_data.aci_data, size);
+				lastActivityAt = millis();
+				METRICS_PIPE(false, pipe, size);
+				EVENT_DBUG_LOG(F("ACI_EVT_DATA_RECEIVED Pipe #:"));
+				EVENT_DBUG_LOG(pipe, HEX);
+				if (!receiveStreamFragment(pipe, aciEvt->params.data_received.rx_data.aci_data, size) &&
+				    !dispatchReceivedData(pipe, aciEvt->params.data_received.rx_data.aci_data, size) &&
+				    !queueReceivedData(pipe, aciEvt->params.data_received.rx_data.aci_data, size)) {
+					didReceiveData(pipe, aciEvt->params.data_received.rx_data.aci_data, size);
+				}
 				break;
 			}
 
 			case ACI_EVT_DATA_CREDIT:
 				aciState.data_credit_available = aciState.data_credit_available + aciEvt->params.data_credit.credit;
+				if (aciState.data_credit_available > aciState.data_credit_total) {
+					aciState.data_credit_available = aciState.data_credit_total;
+				}
+				METRICS_COUNT(creditRefills);
 				ack = true;
-        DBUG_LOG(F("ACI_EVT_DATA_CREDIT"));
-        DBUG_LOG(aciState.data_credit_available, DEC);
+        EVENT_DBUG_LOG(F("ACI_EVT_DATA_CREDIT"));
+        EVENT_DBUG_LOG(aciState.data_credit_available, DEC);
 				break;
 
 			case ACI_EVT_PIPE_ERROR:
 				ack = true;
-				ERROR_LOG(F("ACI_EVT_PIPE_ERROR"));
+				EVENT_ERROR_LOG(F("ACI_EVT_PIPE_ERROR"));
 				didReceiveError(aciEvt->params.pipe_error.pipe_number, aciEvt->params.pipe_error.error_code);
 				incrementCredit();
 				break;
 		}
 	}
+	sendQueuedCommand();
+	sendQueuedData();
+	sendStreamFragments();
+	manageTiming();
+	manageBroadcast();
+	manageRecovery();
+	return handled;
 }
 
 void BlueCapPeripheral::setup() {
-  if (maxBonds > 0) {
-    DBUG_LOG(F("BlueCapPeripheral::begin"));
-    DBUG_LOG(F("Number of bonded devices:"));
-    DBUG_LOG(numberOfBondedDevices(), DEC);
+  if (bondingEnabled()) {
+    BOND_DBUG_LOG(F("BlueCapPeripheral::begin"));
+    BOND_DBUG_LOG(F("Number of bonded devices:"));
+    BOND_DBUG_LOG(numberOfBondedDevices(), DEC);
   }
 
 	aciState.aci_setup_info.services_pipe_type_mapping 	= servicesPipeTypeMapping;
@@ -328,68 +767,491 @@ void BlueCapPeripheral::setup() {
 	aciState.aci_pins.optional_chip_sel_pin = UNUSED;
 
 	aciState.aci_pins.interface_is_interrupt	= false;
-	aciState.aci_pins.interrupt_number			  = 1;
+	aciState.aci_pins.interrupt_number			  = interruptNumber;
+
+  for(int i = 0; bondingEnabled() && i < bonding->maxBonds; i++) {
+    bonding->bonds[i].setup(&aciState);
+  }
 
+  startupAt = millis();
+  startupDuration = 0;
+  deviceStarted = false;
 	lib_aci_init(&aciState);
-	delay(100);
 
-  for(int i = 0; i < maxBonds; i++) {
-    bonds[i].setup(&aciState);
+  if (interruptMode) {
+    interruptPeripheral = this;
+    attachInterrupt(interruptNumber, rdynInterrupt, LOW);
+    EVENT_DBUG_LOG(F("RDYN interrupt attached"));
+  }
+
+  uint32_t startupWait = isSetupStored() ? STARTUP_PROBE_WAIT_MILLISECONDS : STARTUP_TIMEOUT_MILLISECONDS;
+  while (!deviceStarted && millis() - startupAt < startupWait) {
+    listen();
+  }
+  if (!deviceStarted) {
+    resumeConfiguredRadio();
+  }
+}
+
+void BlueCapPeripheral::enableFastStartup(uint16_t address) {
+  fingerprintAddress = address;
+}
+
+uint16_t BlueCapPeripheral::setupFingerprint() {
+  uint16_t crc = 0xFFFF;
+  for (int i = 0; i < numberOfSetupMessages; i++) {
+    uint8_t len = pgm_read_byte(&setUpMessages[i].buffer[0]);
+    for (uint8_t j = 0; j <= len && j < sizeof(setUpMessages[i].buffer); j++) {
+      crc = updateCrc(crc, pgm_read_byte(&setUpMessages[i].buffer[j]));
+    }
+  }
+  return crc;
+}
+
+uint32_t BlueCapPeripheral::startupTime() {
+  return startupDuration;
+}
+
+void BlueCapPeripheral::startAdvertising() {
+  if (bondingEnabled()) {
+    bonding->disconnectedAt = millis();
+    startReconnect();
+    advertiseBond();
+  } else if (broadcastEnabled()) {
+    broadcast();
+    didStartAdvertising();
+    EVENT_DBUG_LOG(F("Advertising broadcast started"));
+  } else {
+    connect();
+    didStartAdvertising();
+    EVENT_DBUG_LOG(F("Bonding not configured. Advertising started"));
+  }
+  if (startupDuration == 0) {
+    startupDuration = millis() - startupAt;
+    EVENT_DBUG_LOG(F("Startup milliseconds:"));
+    EVENT_DBUG_LOG(startupDuration, DEC);
+  }
+}
+
+bool BlueCapPeripheral::isSetupStored() {
+  if (fingerprintAddress == NO_FINGERPRINT_ADDRESS || bondStore == NULL) {
+    return false;
+  }
+  uint16_t stored = bondStore->read(fingerprintAddress) | (bondStore->read(fingerprintAddress + 1) << 8);
+  return stored == setupFingerprint();
+}
+
+void BlueCapPeripheral::resumeConfiguredRadio() {
+  if (isSetupStored()) {
+    startupProbe = true;
+    startupProbeSucceeded = false;
+    cmdComplete = false;
+    if (lib_aci_device_version()) {
+      uint32_t probeAt = millis();
+      while (startupProbe && !deviceStarted && millis() - probeAt < STARTUP_PROBE_TIMEOUT_MILLISECONDS) {
+        listen();
+      }
+    }
+    startupProbe = false;
+    cmdComplete = true;
+    if (deviceStarted) {
+      // the radio was starting up after all and is being set up normally
+      return;
+    }
+    if (startupProbeSucceeded) {
+      EVENT_DBUG_LOG(F("Radio already configured, skipping setup"));
+      deviceStarted = true;
+      aciState.data_credit_total = savedCreditTotal();
+      aciState.data_credit_available = aciState.data_credit_total;
+      startAdvertising();
+      return;
+    }
+    // no answer, give a slow start the rest of the usual startup wait
+    while (!deviceStarted && millis() - startupAt < STARTUP_TIMEOUT_MILLISECONDS) {
+      listen();
+    }
+    if (deviceStarted) {
+      return;
+    }
+  }
+  EVENT_DBUG_LOG(F("No ACI_EVT_DEVICE_STARTED, resetting radio"));
+  lib_aci_radio_reset();
+}
+
+uint8_t BlueCapPeripheral::savedCreditTotal() {
+  uint8_t credits = 0;
+  if (fingerprintAddress != NO_FINGERPRINT_ADDRESS && bondStore != NULL) {
+    credits = bondStore->read(fingerprintAddress + 2);
+  }
+  if (credits == 0 || credits == 0xFF) {
+    EVENT_ERROR_LOG(F("No saved credit total, using 1"));
+    credits = 1;
+  }
+  return credits;
+}
+
+void BlueCapPeripheral::saveSetupFingerprint() {
+  if (fingerprintAddress != NO_FINGERPRINT_ADDRESS && bondStore != NULL) {
+    uint16_t fingerprint = setupFingerprint();
+    bondStore->write(fingerprintAddress, fingerprint & 0xFF);
+    bondStore->write(fingerprintAddress + 1, fingerprint >> 8);
+    bondStore->write(fingerprintAddress + 2, aciState.data_credit_total);
+    bondStore->flush();
   }
 }
 
 void BlueCapPeripheral::incrementCredit() {
-	aciState.data_credit_available++;
-	DBUG_LOG(F("Data Credit available:"));
-	DBUG_LOG(aciState.data_credit_available,DEC);
+	if (aciState.data_credit_available < aciState.data_credit_total) {
+		aciState.data_credit_available++;
+	}
+	TRACE(TRACE_CREDIT, 1, 0, aciState.data_credit_available);
+	CREDIT_DBUG_LOG(F("Data Credit available:"));
+	CREDIT_DBUG_LOG(aciState.data_credit_available,DEC);
 }
 
 void BlueCapPeripheral::decrementCredit() {
 	aciState.data_credit_available--;
-	DBUG_LOG(F("Data Credit available:"));
-	DBUG_LOG(aciState.data_credit_available, DEC);
+	TRACE(TRACE_CREDIT, 0, 0, aciState.data_credit_available);
+	CREDIT_DBUG_LOG(F("Data Credit available:"));
+	CREDIT_DBUG_LOG(aciState.data_credit_available, DEC);
 }
 
 void BlueCapPeripheral::waitForCredit() {
+	METRICS_TIMER(start);
 	while(aciState.data_credit_available == 0){listen();}
+	METRICS_LATENCY(creditWait, start);
 }
 
 void BlueCapPeripheral::waitForAck() {
-		decrementCredit();
+		METRICS_TIMER(start);
 		ack = false;
 		while(!ack){listen();}
+		METRICS_LATENCY(ackWait, start);
 }
 
 void BlueCapPeripheral::waitForCmdComplete () {
+	METRICS_TIMER(start);
 	while(!cmdComplete){listen();};
+	METRICS_LATENCY(cmdWait, start);
+}
+
+void BlueCapPeripheral::recordPipe(bool tx, uint8_t pipe, uint8_t size) {
+  if (metricsData == NULL) {
+    return;
+  }
+  BlueCapPipeMetrics* counters = pipe < pipeMetricsCount ? &pipeMetrics[pipe] : &metricsData->otherPipes;
+  if (tx) {
+    counters->txPackets++;
+    counters->txBytes += size;
+  } else {
+    counters->rxPackets++;
+    counters->rxBytes += size;
+  }
+}
+
+void BlueCapPeripheral::recordLatency(BlueCapLatencyHistogram* histogram, uint32_t start) {
+  uint32_t elapsed = micros() - start;
+  uint8_t bucket = 0;
+  while (elapsed > 0 && bucket < LATENCY_BUCKETS - 1) {
+    elapsed >>= 1;
+    bucket++;
+  }
+  if (histogram->buckets[bucket] < 0xFFFF) {
+    histogram->buckets[bucket]++;
+  }
+}
+
+void BlueCapPeripheral::trace(uint8_t id, uint8_t opcode, uint8_t pipe, uint8_t value) {
+  if (traceBuffer == NULL) {
+    return;
+  }
+  BlueCapTraceRecord* record = &traceBuffer[traceHead];
+  record->id = id;
+  record->opcode = opcode;
+  record->pipe = pipe;
+  record->value = value;
+  record->timestamp = micros();
+  traceHead = (traceHead + 1) % traceSize;
+  if (traceCount < traceSize) {
+    traceCount++;
+  }
+}
+
+bool BlueCapPeripheral::nextEvent(hal_aci_evt_t* event) {
+  if (interruptMode) {
+    uint8_t tail = eventQueueTail;
+    if (tail == eventQueueHead) {
+      return false;
+    }
+    memcpy(event, &eventQueue[tail & (eventQueueSize - 1)], sizeof(hal_aci_evt_t));
+    eventQueueTail = tail + 1;
+    if (eventQueueStalled) {
+      eventQueueStalled = false;
+      attachInterrupt(interruptNumber, rdynInterrupt, LOW);
+    }
+    return true;
+  }
+  return lib_aci_event_get(&aciState, event);
+}
+
+void BlueCapPeripheral::rdynInterrupt() {
+  if (interruptPeripheral != NULL) {
+    interruptPeripheral->queueEvent();
+  }
+}
+
+void BlueCapPeripheral::queueEvent() {
+  uint8_t head = eventQueueHead;
+  uint8_t count = head - eventQueueTail;
+  if (count == eventQueueSize) {
+    // leave the event in the nRF8001 until listen() makes room
+    detachInterrupt(interruptNumber);
+    eventQueueStalled = true;
+    eventQueueOverflows++;
+    return;
+  }
+  if (lib_aci_event_get(&aciState, &eventQueue[head & (eventQueueSize - 1)])) {
+    eventQueueHead = head + 1;
+    if (count + 1 > eventQueueHighWater) {
+      eventQueueHighWater = count + 1;
+    }
+  }
+}
+
+bool BlueCapPeripheral::canSendData() {
+  if (!isConnected || aciState.data_credit_available == 0) {
+    return false;
+  }
+  return !stopAndWait || packetsInFlight() == 0;
+}
+
+void BlueCapPeripheral::sendQueuedData() {
+  while (txQueueCount > 0 && canSendData()) {
+    BlueCapTxPacket* packet = &txQueue[txQueueHead];
+    uint8_t pipe = packet->pipe;
+    bool status = false;
+    if (isPipeAvailable(pipe)) {
+      if (!lib_aci_send_data(pipe, packet->data, packet->size)) {
+        COMMAND_ERROR_LOG(F("sendQueuedData: ACI command queue full"));
+        break;
+      }
+      decrementCredit();
+      lastActivityAt = millis();
+      METRICS_PIPE(true, pipe, packet->size);
+      status = true;
+    } else {
+      METRICS_COUNT(sendFailures);
+    }
+    TRACE(TRACE_SEND, status, pipe, 0);
+    txQueueHead = (txQueueHead + 1) % txQueueSize;
+    txQueueCount--;
+    didSendData(pipe, status);
+  }
+}
+
+bool BlueCapPeripheral::dispatchReceivedData(uint8_t pipe, uint8_t* data, uint8_t size) {
+  if (pipe >= pipeHandlerCount || pipeHandlers[pipe].handler == NULL) {
+    return false;
+  }
+  PipeHandler* entry = &pipeHandlers[pipe];
+  if (entry->expectedSize != 0 && entry->expectedSize != size) {
+    EVENT_ERROR_LOG(F("dispatchReceivedData: unexpected size on pipe:"));
+    EVENT_ERROR_LOG(pipe, HEX);
+    return true;
+  }
+  entry->handler(this, pipe, data, size);
+  return true;
+}
+
+bool BlueCapPeripheral::queueReceivedData(uint8_t pipe, uint8_t* data, uint8_t size) {
+  if (rxQueue == NULL) {
+    return false;
+  }
+  if (rxQueueCount == rxQueueSize) {
+    rxQueueDrops++;
+    EVENT_ERROR_LOG(F("queueReceivedData: queue full, dropped pipe:"));
+    EVENT_ERROR_LOG(pipe, HEX);
+    return true;
+  }
+  BlueCapRxPacket* packet = &rxQueue[(rxQueueHead + rxQueueCount) % rxQueueSize];
+  packet->pipe = pipe;
+  packet->size = size;
+  memcpy(packet->data, data, size);
+  rxQueueCount++;
+  return true;
+}
+
+void BlueCapPeripheral::clearTxQueue() {
+  while (txQueueCount > 0) {
+    uint8_t pipe = txQueue[txQueueHead].pipe;
+    txQueueHead = (txQueueHead + 1) % txQueueSize;
+    txQueueCount--;
+    didSendData(pipe, false);
+  }
 }
 
 // BlueCapBond
-void BlueCapPeripheral::nextBondIndex() {
-  currentBondIndex++;
-  if (currentBondIndex > numberOfBondedDevices() - 1) {
-    currentBondIndex = 0;
+void BlueCapPeripheral::initBonds(uint16_t _eepromOffset) {
+  if (bonding == NULL) {
+    return;
+  }
+  bonding->bondOffset = _eepromOffset;
+  bonding->currentBondIndex = 0;
+  bonding->bondedCount = 0;
+  bonding->newBondCount = 0;
+  bonding->activeBondCount = 0;
+  bonding->reconnectPosition = 0;
+  bonding->reconnectFast = true;
+  bonding->disconnectedAt = 0;
+  bonding->fastAdvertisingSeconds = RECONNECT_FAST_TIMEOUT_SECONDS;
+  bonding->fastAdvertisingInterval = RECONNECT_FAST_ADVERTISING_INTERVAL;
+  bonding->slowAdvertisingSeconds = RECONNECT_SLOW_TIMEOUT_SECONDS;
+  bonding->slowAdvertisingInterval = RECONNECT_SLOW_ADVERTISING_INTERVAL;
+  bonding->bondOperation = BOND_IDLE;
+  bonding->bondDataAddress = 0;
+  bonding->bondMessageCount = 0;
+  bonding->bondSlot = 0;
+  bonding->bondCrc = 0;
+  memset(bonding->bondedMask, 0, 2*((bonding->maxBonds + 7) >> 3));
+  for (int i = 0; i < bonding->maxBonds; i++) {
+    bonding->bondOrder[i] = i;
+    bonding->reconnectLatencies[i] = 0;
+    bonding->bonds[i].init(this);
   }
-  DBUG_LOG(F("nextBondIndex:"));
-  DBUG_LOG(currentBondIndex, DEC);
 }
 
-uint8_t BlueCapPeripheral::numberOfBondedDevices() {
-  uint8_t count = 0;
-  for (int i = 0; i < maxBonds; i++) {
-    if (bonds[i].bonded || bonds[i].newBond) {
-      count++;
+void BlueCapPeripheral::advertiseBond() {
+  if (!bonding->bonds[bonding->currentBondIndex].restoreIfBonded(this, &aciState)) {
+    bonding->bonds[bonding->currentBondIndex].connectOrBond(this);
+    didStartAdvertising();
+  }
+}
+
+void BlueCapPeripheral::startBondOperation(uint8_t operation, uint16_t dataAddress, uint8_t messageCount) {
+  bonding->bondOperation = operation;
+  bonding->bondDataAddress = dataAddress;
+  bonding->bondMessageCount = messageCount;
+  cmdComplete = false;
+  TRACE(TRACE_BOND, operation, bonding->currentBondIndex, messageCount);
+}
+
+void BlueCapPeripheral::finishBondOperation(bool success) {
+  uint8_t operation = bonding->bondOperation;
+  bonding->bondOperation = BOND_IDLE;
+  cmdComplete = true;
+  TRACE(TRACE_BOND, BOND_IDLE, bonding->currentBondIndex, success);
+  if (BOND_RESTORING == operation) {
+    didRestoreBond(bonding->currentBondIndex, success);
+    if (success) {
+      BOND_DBUG_LOG(F("Bond restored successfully: Waiting for connection"));
+      bonding->bonds[bonding->currentBondIndex].connectOrBond(this);
+      didStartAdvertising();
+    } else {
+      // keep advertising so the window times out and the next bond is tried
+      BOND_ERROR_LOG(F("Bond restore failed. Advertising without it"));
+      connectBond();
+      didStartAdvertising();
+    }
+  } else {
+    if (!success) {
+      BOND_ERROR_LOG(F("Bond data read and store failed"));
     }
+    didSaveBond(bonding->currentBondIndex, success);
+    startReconnect();
+    advertiseBond();
   }
-  return count;
 }
 
-uint8_t BlueCapPeripheral::numberOfNewBonds() {
-  uint8_t count = 0;
-  for (int i = 0; i < maxBonds; i++) {
-    if (bonds[i].newBond) {
-      count++;
+void BlueCapPeripheral::connectBond() {
+  if (bonding->reconnectFast) {
+    connect(bonding->fastAdvertisingSeconds, bonding->fastAdvertisingInterval);
+  } else {
+    connect(bonding->slowAdvertisingSeconds, bonding->slowAdvertisingInterval);
+  }
+}
+
+void BlueCapPeripheral::startReconnect() {
+  bonding->reconnectPosition = bonding->maxBonds - 1;
+  nextBondIndex();
+  bonding->reconnectFast = true;
+}
+
+void BlueCapPeripheral::didReconnectBond() {
+  uint32_t latency = millis() - bonding->disconnectedAt;
+  bonding->reconnectLatencies[bonding->currentBondIndex] = latency;
+  uint8_t position = 0;
+  while (position < bonding->maxBonds - 1 && bonding->bondOrder[position] != bonding->currentBondIndex) {
+    position++;
+  }
+  for (; position > 0; position--) {
+    bonding->bondOrder[position] = bonding->bondOrder[position - 1];
+  }
+  bonding->bondOrder[0] = bonding->currentBondIndex;
+  BOND_DBUG_LOG(F("Reconnect latency:"));
+  BOND_DBUG_LOG(latency, DEC);
+  didReconnect(bonding->currentBondIndex, latency);
+}
+
+void BlueCapPeripheral::nextBondIndex() {
+  for (uint8_t i = 0; i < bonding->maxBonds; i++) {
+    bonding->reconnectPosition++;
+    if (bonding->reconnectPosition >= bonding->maxBonds) {
+      bonding->reconnectPosition = 0;
+      bonding->reconnectFast = false;
+    }
+    uint8_t index = bonding->bondOrder[bonding->reconnectPosition];
+    uint8_t bit = 1 << (index & 0x07);
+    if ((bonding->bondedMask[index >> 3] | bonding->newBondMask[index >> 3]) & bit) {
+      bonding->currentBondIndex = index;
+      BOND_DBUG_LOG(F("nextBondIndex:"));
+      BOND_DBUG_LOG(bonding->currentBondIndex, DEC);
+      return;
     }
   }
-  return count;
+  bonding->currentBondIndex = 0;
+  BOND_DBUG_LOG(F("nextBondIndex:"));
+  BOND_DBUG_LOG(bonding->currentBondIndex, DEC);
+}
+
+uint8_t BlueCapPeripheral::nextBondIndex(uint8_t fromIndex, bool active) {
+  for (uint16_t i = fromIndex; bondingEnabled() && i < bonding->maxBonds; i++) {
+    uint8_t bits = (bonding->bondedMask[i >> 3] | bonding->newBondMask[i >> 3]) >> (i & 0x07);
+    if (!active) {
+      bits = ~bits & (0xFF >> (i & 0x07));
+    }
+    if (bits == 0) {
+      i |= 0x07;
+    } else if (bits & 0x01) {
+      return i;
+    }
+  }
+  return NO_BOND_INDEX;
+}
+
+void BlueCapPeripheral::setBondState(uint8_t index, bool bonded, bool newBond) {
+  uint8_t byte = index >> 3;
+  uint8_t bit = 1 << (index & 0x07);
+  bool wasBonded = bonding->bondedMask[byte] & bit;
+  bool wasNewBond = bonding->newBondMask[byte] & bit;
+  if (bonded) {
+    bonding->bondedMask[byte] |= bit;
+  } else {
+    bonding->bondedMask[byte] &= ~bit;
+  }
+  if (newBond) {
+    bonding->newBondMask[byte] |= bit;
+  } else {
+    bonding->newBondMask[byte] &= ~bit;
+  }
+  bonding->bondedCount += (int8_t)bonded - (int8_t)wasBonded;
+  bonding->newBondCount += (int8_t)newBond - (int8_t)wasNewBond;
+  bonding->activeBondCount += (int8_t)(bonded || newBond) - (int8_t)(wasBonded || wasNewBond);
+}
+
+uint8_t BlueCapPeripheral::numberOfBondedDevices() {
+  return bondingEnabled() ? bonding->activeBondCount : 0;
+}
+
+uint8_t BlueCapPeripheral::numberOfNewBonds() {
+  return bondingEnabled() ? bonding->newBondCount : 0;
 }
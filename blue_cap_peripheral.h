@@ -2,24 +2,141 @@
 #define _BLUE_CAP_PERIPHERAL_H
 
 #include "lib_aci.h"
+#include "blue_cap_bond_store.h"
+#include "blue_cap_log.h"
+#include "blue_cap_metrics.h"
 
-#define BOND_HEADER_BYTES                 2
+#ifndef BOND_SLOTS
+#define BOND_SLOTS                        2
+#endif
+
+#ifndef BOND_DATA_BYTES
+#define BOND_DATA_BYTES                   96
+#endif
+
+#define BOND_RECORD_MARKER                0
+#define BOND_RECORD_SEQUENCE              1
+#define BOND_RECORD_MESSAGES              2
+#define BOND_RECORD_SIZE                  3
+#define BOND_RECORD_CRC                   4
+#define BOND_RECORD_HEADER_BYTES          6
+#define BOND_RECORD_BYTES                 (BOND_RECORD_HEADER_BYTES + BOND_DATA_BYTES)
+
+#define BOND_RECORD_WRITING               0x00
+#define BOND_RECORD_CLEARED               0x5A
+#define BOND_RECORD_COMMITTED             0xA5
+
+#define BOND_IDLE                         0
+#define BOND_RESTORING                    1
+#define BOND_SAVING                       2
+
+#define NO_BOND_INDEX                     0xFF
+#define NO_FINGERPRINT_ADDRESS            0xFFFF
+
+#ifndef BOND_STATE_BYTES
+#define BOND_STATE_BYTES                  4
+#endif
+
+// Library-wide switches, edit them here rather than in a sketch. Setting
+// one to 0 makes that mode's checks in the event loop constant-false so its
+// code can be dropped. Which state a peripheral carries is chosen by the
+// BlueCapModePeripheral mode below.
+#ifndef BOND_SUPPORT
+#define BOND_SUPPORT                      1
+#endif
+
+#ifndef BROADCAST_SUPPORT
+#define BROADCAST_SUPPORT                 1
+#endif
+
+#define BLUE_CAP_PLAIN                    0
+#define BLUE_CAP_BONDED                   1
+#define BLUE_CAP_BROADCAST                2
+
+#define TIMING_PROFILE_DEFAULT            0
+#define TIMING_PROFILE_THROUGHPUT         1
+#define TIMING_PROFILE_LOW_POWER          2
+
+#define POWER_STATE_ACTIVE                0
+#define POWER_STATE_IDLE                  1
+#define POWER_STATE_SLEEP                 2
+#define POWER_STATES                      3
+
+#define RECOVERY_IDLE                     0
+#define RECOVERY_RETRY                    1
+#define RECOVERY_RESET                    2
+#define RECOVERY_RESETTING                3
+#define RECOVERY_RESTART                  4
+#define RECOVERY_RETRYING                 5
+
+#ifndef BROADCAST_TIMEOUT_SECONDS
+#define BROADCAST_TIMEOUT_SECONDS                     10
+#endif
+
+#ifndef BROADCAST_ADVERTISING_INTERVAL_MILISECONDS
+#define BROADCAST_ADVERTISING_INTERVAL_MILISECONDS    0x0100
+#endif
+
+#define NO_BROADCAST_FRAME                0xFF
+
+#define STREAM_HEADER_BYTES               1
+#define STREAM_FIRST_FRAGMENT             0x80
+#define STREAM_LAST_FRAGMENT              0x40
+#define STREAM_SEQUENCE_MASK              0x3F
+
+class BlueCapPeripheral;
+
+struct BlueCapTxPacket {
+  uint8_t               pipe;
+  uint8_t               size;
+  uint8_t               data[ACI_PIPE_TX_DATA_MAX_LEN];
+};
+
+struct BlueCapCommandEntry {
+  uint8_t               opcode;
+  uint8_t               pipe;
+  uint8_t               size;
+  uint8_t               data[ACI_PIPE_TX_DATA_MAX_LEN];
+};
+
+struct BlueCapRxPacket {
+  uint8_t               pipe;
+  uint8_t               size;
+  uint8_t               data[ACI_PIPE_RX_DATA_MAX_LEN];
+};
+
+struct BlueCapBroadcastFrame {
+  uint8_t               pipe;
+  uint8_t               size;
+  uint16_t              dwellMilliseconds;
+  bool                  pushed;
+  uint8_t               data[ACI_PIPE_TX_DATA_MAX_LEN];
+};
+
+typedef void (*BlueCapPipeHandler)(BlueCapPeripheral* peripheral, uint8_t pipe, uint8_t* data, uint8_t size);
 
 class BlueCapPeripheral {
 
 public:
 
   BlueCapPeripheral(uint8_t _reqnPin, uint8_t _rdynPin);
-  BlueCapPeripheral(uint8_t _reqnPin, uint8_t _rdynPin, uint16_t _eepromOffset);
-  BlueCapPeripheral(uint8_t _reqnPin, uint8_t _rdynPin, uint16_t _eepromOffset, uint8_t _maxBonds);
 
-  ~BlueCapPeripheral();
+  struct PipeHandler {
+    BlueCapPipeHandler    handler;
+    uint8_t               expectedSize;
+  };
 
   virtual void begin(){setup();};
-  virtual void loop(){listen();};
+  virtual void loop();
 
   void clearBondData();
   bool addBond();
+  uint8_t bondCount();
+  uint8_t freeBondSlots();
+  bool isBonded(uint8_t index);
+  uint8_t nextBondedIndex(uint8_t fromIndex);
+  uint32_t reconnectLatency(uint8_t index);
+  void setReconnectWindows(uint16_t fastSeconds, uint16_t fastInterval, uint16_t slowSeconds, uint16_t slowInterval);
 
   bool sendAck(const uint8_t pipe);
   bool sendNack(const uint8_t pipe, const uint8_t error_code);
@@ -32,11 +149,97 @@ public:
   bool getDeviceVersion();
   bool getBLEAddress();
   bool connect();
+  bool connect(uint16_t timeout, uint16_t interval);
   bool bond();
   bool broadcast();
+  bool broadcast(uint16_t timeout, uint16_t interval);
+  bool changeTiming(uint16_t minInterval, uint16_t maxInterval, uint16_t latency, uint16_t timeout);
   bool radioReset();
   bool sleep();
-
+  bool wakeup();
+
+  void setStopAndWait(bool enabled);
+  uint8_t packetsInFlight();
+  uint32_t bondBytesWritten();
+  void setBondStore(BlueCapBondStore* store);
+
+  bool setCommandQueue(BlueCapCommandEntry* queue, uint8_t size);
+  bool queueSetData(uint8_t pipe, uint8_t* value, uint8_t size);
+  bool queueSetTxPower(aci_device_output_power_t txPower);
+  bool queueGetBatteryLevel();
+  bool queueGetTemperature();
+  bool queueGetDeviceVersion();
+  bool queueGetBLEAddress();
+  uint8_t commandQueueDepth();
+
+  bool setReceiveQueue(BlueCapRxPacket* queue, uint8_t size);
+  uint8_t* peekData(uint8_t* pipe, uint8_t* size);
+  void releaseData();
+  uint8_t rxQueueDepth();
+  uint16_t rxQueueDropCount();
+
+  bool setTransmitQueue(BlueCapTxPacket* queue, uint8_t size);
+  bool enqueueData(uint8_t pipe, uint8_t* value, uint8_t size);
+  void setLatestValue(uint8_t pipe, bool enabled);
+  bool isLatestValue(uint8_t pipe);
+  uint16_t coalescedUpdates();
+  uint8_t txQueueDepth();
+  uint8_t txQueueDepth(uint8_t pipe);
+
+  bool sendStream(uint8_t pipe, const uint8_t* buffer, uint32_t size);
+  bool sendStream(uint8_t pipe, uint32_t size);
+  bool isStreaming();
+  void setStreamReceiveBuffer(uint8_t pipe, uint8_t* buffer, uint16_t size);
+
+  bool setInterruptMode(uint8_t _interruptNumber, hal_aci_evt_t* queue, uint8_t size);
+  uint8_t eventQueueDepth();
+  uint8_t eventQueueHighWaterMark();
+  uint16_t eventQueueOverflowCount();
+
+  void setAdaptiveTiming(bool enabled);
+  uint8_t timingProfile();
+  uint16_t connectionInterval();
+  uint16_t slaveLatency();
+  uint16_t supervisionTimeout();
+
+  // Stores the setup fingerprint and the radio's credit total in the three
+  // bond store bytes at address.
+  void enableFastStartup(uint16_t address);
+  uint16_t setupFingerprint();
+  uint32_t startupTime();
+
+  void setPowerManagement(bool enabled);
+  void setAdvertisingPause(uint16_t seconds);
+  uint8_t powerState();
+  uint32_t powerStateTime(uint8_t state);
+  void resetPowerStats();
+
+  bool isRecovering();
+  uint16_t commandErrorCount();
+  uint16_t radioResetCount();
+  uint16_t recoveryCount();
+  uint32_t lastRecoveryTime();
+
+  uint8_t drainEvents(uint8_t maxEvents, uint32_t budgetMicros);
+  void setDrainBudget(uint8_t maxEvents, uint32_t budgetMicros);
+  bool hasEventBacklog();
+
+  // pipes is indexed by pipe number, so pipeCount is the number of pipes plus one
+  bool setMetrics(BlueCapMetrics* _metrics, BlueCapPipeMetrics* pipes, uint8_t pipeCount);
+  const BlueCapMetrics* metrics();
+  void resetMetrics();
+
+  // Frames are pushed with queueSetData(), so setCommandQueue() is needed too.
+  void setBroadcastWindow(uint16_t seconds, uint16_t interval);
+  bool setBroadcastFrames(BlueCapBroadcastFrame* frames, uint8_t count);
+  bool setBroadcastFrame(uint8_t frame, uint8_t pipe, uint8_t* data, uint8_t size, uint16_t dwellMilliseconds);
+  void clearBroadcastFrames();
+  uint8_t broadcastFrame();
+  uint16_t broadcastSkippedUpdates();
+
+  bool setTraceBuffer(BlueCapTraceRecord* buffer, uint8_t size);
+  uint8_t traceDepth();
+  void dumpTrace(Print& out);
 
 protected:
 
@@ -49,16 +252,100 @@ protected:
   virtual void didReceiveError(uint8_t pipe, uint8_t errorCode){};
   virtual void didReceivePipeStatusChange(){};
   virtual void didBond(){};
+  virtual void didRestoreBond(uint8_t index, bool success){};
+  virtual void didSaveBond(uint8_t index, bool success){};
+  virtual void didReconnect(uint8_t index, uint32_t latency){};
+  virtual void didSendData(uint8_t pipe, bool success){};
+  virtual void didSendStream(uint8_t pipe, bool success){};
+  virtual void didReceiveStream(uint8_t pipe, uint8_t* data, uint16_t size){};
+  virtual void didSetData(uint8_t pipe, bool success){};
+  virtual void didSetTxPower(bool success){};
+  virtual void didGetBatteryLevel(bool success, uint16_t millivolts){};
+  virtual void didGetTemperature(bool success, int16_t quarterDegrees){};
+  virtual void didGetDeviceVersion(bool success, uint16_t configurationId, uint8_t aciVersion, uint32_t setupId){};
+  virtual void didGetBLEAddress(bool success, uint8_t* address){};
+  virtual uint8_t readStreamData(uint8_t pipe, uint32_t offset, uint8_t* buffer, uint8_t size){return 0;};
   virtual bool doTimingChange(){return true;};
+  virtual void didChangeTiming(uint16_t interval, uint16_t latency, uint16_t timeout){};
+  virtual void didReceiveCommandError(uint8_t commandId, uint8_t status){};
+  virtual void didRecover(uint32_t milliseconds){};
 
   void setServicePipeTypeMapping(services_pipe_type_mapping_t* mapping, int count);
+  // table is indexed by pipe number, so size is the number of pipes plus one
+  bool setPipeHandlers(PipeHandler* table, uint8_t size);
+  bool setPipeHandler(uint8_t pipe, BlueCapPipeHandler handler, uint8_t expectedSize);
   void setSetUpMessages(hal_aci_data_t* messages, int count);
 
   bool isPipeAvailable(uint8_t pipe);
 
 protected:
 
-  bool                            broadcasting;
+  class BlueCapBond;
+
+  struct BondingState {
+    BlueCapBond*          bonds;
+    uint8_t*              bondedMask;
+    uint8_t*              newBondMask;
+    uint8_t*              bondOrder;
+    uint32_t*             reconnectLatencies;
+    uint8_t               maxBonds;
+    uint16_t              bondOffset;
+    uint8_t               currentBondIndex;
+    uint8_t               bondedCount;
+    uint8_t               newBondCount;
+    uint8_t               activeBondCount;
+    uint32_t              disconnectedAt;
+    uint8_t               reconnectPosition;
+    bool                  reconnectFast;
+    uint16_t              fastAdvertisingSeconds;
+    uint16_t              fastAdvertisingInterval;
+    uint16_t              slowAdvertisingSeconds;
+    uint16_t              slowAdvertisingInterval;
+    uint8_t               bondOperation;
+    uint16_t              bondDataAddress;
+    uint8_t               bondMessageCount;
+    uint8_t               bondSlot;
+    uint16_t              bondCrc;
+  };
+
+  template <uint8_t MAX_BONDS>
+  struct BondStorage {
+    BondStorage() {
+      bondingState.bonds = bondArray;
+      bondingState.bondedMask = maskArray;
+      bondingState.newBondMask = maskArray + sizeof(maskArray)/2;
+      bondingState.bondOrder = orderArray;
+      bondingState.reconnectLatencies = latencyArray;
+      bondingState.maxBonds = MAX_BONDS;
+    };
+    BondingState          bondingState;
+    BlueCapBond           bondArray[MAX_BONDS];
+    uint8_t               maskArray[2*((MAX_BONDS + 7) >> 3)];
+    uint8_t               orderArray[MAX_BONDS];
+    uint32_t              latencyArray[MAX_BONDS];
+  };
+
+  struct BroadcastingState {
+    BlueCapBroadcastFrame*  frames;
+    uint8_t                 frameSlots;
+    uint8_t                 frameCount;
+    uint8_t                 currentFrame;
+    uint32_t                frameAt;
+    uint16_t                seconds;
+    uint16_t                interval;
+    uint16_t                skips;
+    uint8_t                 pushFrame;
+    uint8_t                 pushPosition;
+    bool                    pushChanged;
+  };
+
+  struct BroadcastStorage {
+    BroadcastingState       broadcastingState;
+  };
+
+  // used by BlueCapModePeripheral, the state is NULL for the other modes
+  BlueCapPeripheral(uint8_t _reqnPin, uint8_t _rdynPin, uint16_t _eepromOffset, BondingState* _bonding);
+  BlueCapPeripheral(uint8_t _reqnPin, uint8_t _rdynPin, BroadcastingState* _broadcasting);
 
 private:
 
@@ -70,82 +357,263 @@ private:
   bool                            ack;
   bool                            timingChangeDone;
   bool                            cmdComplete;
-  uint8_t                         currentBondIndex;
-  uint8_t*                        rxPipes;
+  bool                            stopAndWait;
   aci_state_t                     aciState;
   hal_aci_evt_t                   aciData;
   uint8_t                         reqnPin;
   uint8_t                         rdynPin;
-  uint8_t                         maxBonds;
 
 private:
 
-  void init(uint8_t _reqnPin, uint8_t _rdynPin, uint16_t _eepromOffset, uint8_t _maxBonds, bool _broadcasting);
-  void listen();
+  BlueCapTxPacket*                txQueue;
+  uint8_t                         txQueueSize;
+  uint8_t                         txQueueHead;
+  uint8_t                         txQueueCount;
+  uint8_t                         latestValuePipes[PIPES_ARRAY_SIZE];
+  uint16_t                        coalescedCount;
+
+  PipeHandler*                    pipeHandlers;
+  uint8_t                         pipeHandlerCount;
+  uint8_t                         pipesOpen[PIPES_ARRAY_SIZE];
+
+  BlueCapRxPacket*                rxQueue;
+  uint8_t                         rxQueueSize;
+  uint8_t                         rxQueueHead;
+  uint8_t                         rxQueueCount;
+  uint16_t                        rxQueueDrops;
+
+  BlueCapCommandEntry*            commandQueue;
+  uint8_t                         commandQueueSize;
+  uint8_t                         commandQueueHead;
+  uint8_t                         commandQueueCount;
+  bool                            commandInFlight;
+
+  BroadcastingState*              broadcasting;
+
+  const uint8_t*                  txStreamBuffer;
+  uint32_t                        txStreamSize;
+  uint32_t                        txStreamOffset;
+  uint8_t                         txStreamPipe;
+  uint8_t                         txStreamSequence;
+  bool                            txStreamActive;
+
+  uint8_t*                        rxStreamBuffer;
+  uint16_t                        rxStreamCapacity;
+  uint16_t                        rxStreamSize;
+  uint8_t                         rxStreamPipe;
+  uint8_t                         rxStreamSequence;
+  bool                            rxStreamActive;
+
+  hal_aci_evt_t*                  eventQueue;
+  uint8_t                         eventQueueSize;
+  volatile uint8_t                eventQueueHead;
+  volatile uint8_t                eventQueueTail;
+  volatile uint8_t                eventQueueHighWater;
+  volatile uint16_t               eventQueueOverflows;
+  volatile bool                   eventQueueStalled;
+  bool                            interruptMode;
+  uint8_t                         drainMaxEvents;
+  bool                            adaptiveTiming;
+  uint8_t                         currentTimingProfile;
+  uint16_t                        timingInterval;
+  uint16_t                        timingLatency;
+  uint16_t                        timingTimeout;
+  uint32_t                        timingChangedAt;
+  uint32_t                        lastActivityAt;
+  uint16_t                        fingerprintAddress;
+  bool                            startupProbe;
+  bool                            startupProbeSucceeded;
+  bool                            deviceStarted;
+  uint32_t                        startupAt;
+  uint32_t                        startupDuration;
+  uint32_t                        drainBudgetMicros;
+  bool                            powerManaged;
+  bool                            radioAsleep;
+  bool                            wakeRequested;
+  uint16_t                        advertisingPauseSeconds;
+  uint32_t                        radioSleepAt;
+  uint8_t                         currentPowerState;
+  uint32_t                        powerStateAt;
+  uint32_t                        powerMillis[POWER_STATES];
+  uint16_t                        powerMicros[POWER_STATES];
+  bool                            recovering;
+  uint8_t                         recoveryStep;
+  uint8_t                         recoveryAttempts;
+  uint8_t                         recoveryOpcode;
+  uint32_t                        recoveryAt;
+  uint32_t                        recoveryDelay;
+  uint32_t                        recoveryStartedAt;
+  uint16_t                        commandErrors;
+  uint16_t                        radioResets;
+  uint16_t                        recoveries;
+  uint32_t                        lastRecoveryMillis;
+  uint8_t                         interruptNumber;
+
+  static BlueCapPeripheral*       interruptPeripheral;
+
+  BlueCapTraceRecord*             traceBuffer;
+  uint8_t                         traceSize;
+  uint8_t                         traceHead;
+  uint8_t                         traceCount;
+
+  BlueCapMetrics*                 metricsData;
+  BlueCapPipeMetrics*             pipeMetrics;
+  uint8_t                         pipeMetricsCount;
+
+private:
+
+  void init(uint8_t _reqnPin, uint8_t _rdynPin, uint16_t _eepromOffset, BondingState* _bonding, BroadcastingState* _broadcasting);
+  bool bondingEnabled(){return BOND_SUPPORT && bonding != NULL;};
+  bool isBondIdle(){return !bondingEnabled() || BOND_IDLE == bonding->bondOperation;};
+  bool broadcastEnabled(){return BROADCAST_SUPPORT && broadcasting != NULL;};
+  bool listen();
   void setup();
+  void startAdvertising();
+  void initTiming();
+  void resetTiming();
+  void updateTiming(uint16_t interval, uint16_t latency, uint16_t timeout);
+  void manageTiming();
+  void initBroadcast();
+  void resetBroadcastFrames();
+  void manageBroadcast();
+  void pushBroadcastFrame();
+  void completeBroadcastPush(bool success);
+  void initPower();
+  void enterPowerState(uint8_t state);
+  bool sleepRadio();
+  void didWakeRadio();
+  void waitForWakeup();
+  bool isPowerIdle();
+  void managePower();
+  void initRecovery();
+  bool isAdvertisingCommand(uint8_t opcode);
+  uint8_t classifyError(uint8_t opcode, uint8_t status);
+  void handleCommandError(uint8_t opcode, uint8_t status);
+  void scheduleRecovery(uint8_t step, uint8_t opcode);
+  void manageRecovery();
+  void abortForRecovery();
+  void didResetRadio();
+  void finishRecovery();
+  bool isSetupStored();
+  void resumeConfiguredRadio();
+  uint8_t savedCreditTotal();
+  void saveSetupFingerprint();
   void incrementCredit();
   void decrementCredit();
   void waitForCredit();
   void waitForAck();
   void waitForCmdComplete();
+  void trace(uint8_t id, uint8_t opcode, uint8_t pipe, uint8_t value);
+  void recordPipe(bool tx, uint8_t pipe, uint8_t size);
+  void recordLatency(BlueCapLatencyHistogram* histogram, uint32_t start);
+  bool nextEvent(hal_aci_evt_t* event);
+  void queueEvent();
+  static void rdynInterrupt();
+  bool canSendData();
+  void sendQueuedData();
+  void clearTxQueue();
+  bool dispatchReceivedData(uint8_t pipe, uint8_t* data, uint8_t size);
+  bool queueReceivedData(uint8_t pipe, uint8_t* data, uint8_t size);
+  bool queueCommand(uint8_t opcode, uint8_t pipe, const uint8_t* data, uint8_t size);
+  void sendQueuedCommand();
+  bool completeQueuedCommand(aci_evt_t* aciEvt);
+  void failQueuedCommand();
+  void initStreams();
+  void sendStreamFragments();
+  void endStream(bool success);
+  bool receiveStreamFragment(uint8_t pipe, uint8_t* data, uint8_t size);
   uint8_t numberOfBondedDevices();
   uint8_t numberOfNewBonds();
 
-private:
+protected:
 
   class BlueCapBond {
 
     public:
 
       BlueCapBond();
-      void init(BlueCapPeripheral* _peripheral, uint16_t _eepromOffset, uint16_t _maxBonds, uint8_t _index);
-      void clearBondData();
+      void init(BlueCapPeripheral* peripheral);
+      void clearBondData(BlueCapPeripheral* peripheral);
       void setup(aci_state_t* aciState);
-      bool restoreIfBonded(aci_state_t* aciState);
-      void writeIfBonded(aci_state_t* aciState, aci_evt_t* aciEvt);
-      void connectOrBond();
+      bool restoreIfBonded(BlueCapPeripheral* peripheral, aci_state_t* aciState);
+      bool writeIfBonded(BlueCapPeripheral* peripheral, aci_state_t* aciState, aci_evt_t* aciEvt);
+      void didReceiveCommandResponse(BlueCapPeripheral* peripheral, aci_state_t* aciState, aci_evt_t* aciEvt);
+      void connectOrBond(BlueCapPeripheral* peripheral);
+      void readBondDirectory(BlueCapPeripheral* peripheral);
 
     public:
 
-      uint16_t              eepromOffset;
-      uint16_t              maxBonds;
-      hal_aci_evt_t         aciData;
-      bool                  bonded;
-      uint8_t               index;
-      bool                  newBond;
-      BlueCapPeripheral*    peripheral;
+      uint8_t               header;
+      uint8_t               dataSize;
+      uint8_t               sequence;
+      uint8_t               activeSlot;
 
     private:
 
       uint8_t status();
-      aci_status_code_t restoreBondData(aci_state_t* aciState);
-      bool readAndWriteBondData(aci_state_t* aciState);
-      uint16_t writeBondData(aci_evt_t* evt, uint16_t addr);
-      uint16_t readBondData(hal_aci_data_t* aciCmd, uint16_t addr);
-      void writeBondDataHeader(uint16_t dataAddress, uint8_t numDynMsgs);
-      uint16_t readBondDataOffset();
-      uint16_t offset();
+      uint8_t index(BlueCapPeripheral* peripheral);
+      void restoreBondData(BlueCapPeripheral* peripheral, aci_state_t* aciState, aci_evt_t* aciEvt);
+      void readAndWriteBondData(BlueCapPeripheral* peripheral, aci_evt_t* aciEvt);
+      bool sendBondData(BlueCapPeripheral* peripheral);
+      bool writeBondData(BlueCapPeripheral* peripheral, aci_evt_t* evt);
+      uint16_t readBondData(BlueCapPeripheral* peripheral, hal_aci_data_t* aciCmd, uint16_t addr);
+      void writeBondDataHeader(BlueCapPeripheral* peripheral, uint16_t dataAddress, uint8_t numDynMsgs);
+      bool isValidRecord(BlueCapPeripheral* peripheral, uint16_t recordOffset, uint8_t* recordHeader);
+      uint16_t readBondDataOffset(BlueCapPeripheral* peripheral);
+      uint16_t offset(BlueCapPeripheral* peripheral, uint8_t slot);
     };
 
 private:
 
-  BlueCapBond*              bonds;
+  BondingState*             bonding;
+  BlueCapBondStore*         bondStore;
+#if defined(ARDUINO)
+  BlueCapEEPROMStore        eepromStore;
+#endif
 
 private:
 
+  void initBonds(uint16_t _eepromOffset);
+  void advertiseBond();
+  void startBondOperation(uint8_t operation, uint16_t dataAddress, uint8_t messageCount);
+  void finishBondOperation(bool success);
+  void connectBond();
+  void startReconnect();
+  void didReconnectBond();
   void nextBondIndex();
+  uint8_t nextBondIndex(uint8_t fromIndex, bool active);
+  void setBondState(uint8_t index, bool bonded, bool newBond);
+
+};
+
+// A peripheral that carries only its mode's state: the bond tables for
+// BLUE_CAP_BONDED and the broadcast frame state for BLUE_CAP_BROADCAST.
+// A BLUE_CAP_PLAIN peripheral is a BlueCapPeripheral.
+template <uint8_t MODE, uint8_t MAX_BONDS = 0>
+class BlueCapModePeripheral;
 
+template <>
+class BlueCapModePeripheral<BLUE_CAP_PLAIN> : public BlueCapPeripheral {
+public:
+  BlueCapModePeripheral(uint8_t _reqnPin, uint8_t _rdynPin) : BlueCapPeripheral(_reqnPin, _rdynPin) {};
 };
 
-class BlueCapBondedPeripheral : public BlueCapPeripheral {
+template <uint8_t MAX_BONDS>
+class BlueCapModePeripheral<BLUE_CAP_BONDED, MAX_BONDS> : private BlueCapPeripheral::BondStorage<MAX_BONDS>, public BlueCapPeripheral {
 public:
-  BlueCapBondedPeripheral(uint8_t _reqnPin, uint8_t _rdynPin, uint16_t _eepromOffset, uint8_t _maxBonds) : BlueCapPeripheral(_reqnPin, _rdynPin, _eepromOffset, _maxBonds) {};
+  BlueCapModePeripheral(uint8_t _reqnPin, uint8_t _rdynPin, uint16_t _eepromOffset) :
+    BlueCapPeripheral(_reqnPin, _rdynPin, _eepromOffset, &this->bondingState) {};
 };
 
-class BlueCapBroadcastingPeripheral : public BlueCapPeripheral {
+template <>
+class BlueCapModePeripheral<BLUE_CAP_BROADCAST> : private BlueCapPeripheral::BroadcastStorage, public BlueCapPeripheral {
 public:
-  BlueCapBroadcastingPeripheral(uint8_t _reqnPin, uint8_t _rdynPin) : BlueCapPeripheral(_reqnPin, _rdynPin){broadcasting = true;};
+  BlueCapModePeripheral(uint8_t _reqnPin, uint8_t _rdynPin) : BlueCapPeripheral(_reqnPin, _rdynPin, &this->broadcastingState) {};
 };
 
-#endif
+template <uint8_t MAX_BONDS>
+using BlueCapBondedPeripheral = BlueCapModePeripheral<BLUE_CAP_BONDED, MAX_BONDS>;
+
+typedef BlueCapModePeripheral<BLUE_CAP_BROADCAST> BlueCapBroadcastingPeripheral;
 
+#endif
@@ -0,0 +1,149 @@
+#include <SPI.h>
+#include "boards.h"
+#include "lib_aci.h"
+#include "aci_setup.h"
+#include "utils.h"
+
+#include "blue_cap_peripheral.h"
+
+#if defined(__AVR__)
+#include <avr/sleep.h>
+#endif
+
+void BlueCapPeripheral::setPowerManagement(bool enabled) {
+  powerManaged = enabled;
+}
+
+void BlueCapPeripheral::setAdvertisingPause(uint16_t seconds) {
+  advertisingPauseSeconds = seconds;
+}
+
+bool BlueCapPeripheral::sleep() {
+  waitForCmdComplete();
+  if (radioAsleep) {
+    return true;
+  }
+  // the nRF8001 does not answer Sleep, so cmdComplete is left alone
+  if (!lib_aci_sleep()) {
+    COMMAND_ERROR_LOG(F("sleep failed"));
+    return false;
+  }
+  TRACE(TRACE_COMMAND, true, 0, ACI_CMD_SLEEP);
+  radioAsleep = true;
+  wakeRequested = false;
+  radioSleepAt = millis();
+  enterPowerState(POWER_STATE_SLEEP);
+  EVENT_DBUG_LOG(F("Radio asleep"));
+  return true;
+}
+
+bool BlueCapPeripheral::wakeup() {
+  if (!radioAsleep) {
+    return false;
+  }
+  if (!wakeRequested) {
+    wakeRequested = lib_aci_wakeup();
+    TRACE(TRACE_COMMAND, wakeRequested, 0, ACI_CMD_WAKEUP);
+    if (!wakeRequested) {
+      COMMAND_ERROR_LOG(F("wakeup failed"));
+    }
+  }
+  return wakeRequested;
+}
+
+uint8_t BlueCapPeripheral::powerState() {
+  return currentPowerState;
+}
+
+uint32_t BlueCapPeripheral::powerStateTime(uint8_t state) {
+  if (state >= POWER_STATES) {
+    return 0;
+  }
+  return powerMillis[state];
+}
+
+void BlueCapPeripheral::resetPowerStats() {
+  memset(powerMillis, 0, sizeof(powerMillis));
+  memset(powerMicros, 0, sizeof(powerMicros));
+  powerStateAt = micros();
+}
+
+// private
+void BlueCapPeripheral::initPower() {
+  powerManaged = false;
+  radioAsleep = false;
+  wakeRequested = false;
+  advertisingPauseSeconds = 0;
+  radioSleepAt = 0;
+  currentPowerState = POWER_STATE_ACTIVE;
+  resetPowerStats();
+}
+
+void BlueCapPeripheral::enterPowerState(uint8_t state) {
+  uint32_t now = micros();
+  uint32_t elapsed = now - powerStateAt + powerMicros[currentPowerState];
+  powerMillis[currentPowerState] += elapsed / 1000;
+  powerMicros[currentPowerState] = elapsed % 1000;
+  powerStateAt = now;
+  currentPowerState = state;
+}
+
+bool BlueCapPeripheral::sleepRadio() {
+  if (!powerManaged || advertisingPauseSeconds == 0 || radioAsleep ||
+      commandQueueCount > 0 || !cmdComplete) {
+    return false;
+  }
+  return sleep();
+}
+
+void BlueCapPeripheral::waitForWakeup() {
+  // the radio ignores commands while asleep, so wake it and wait for its
+  // DEVICE_STARTED before sending one
+  while (radioAsleep) {
+    wakeup();
+    listen();
+  }
+}
+
+void BlueCapPeripheral::didWakeRadio() {
+  if (radioAsleep) {
+    radioAsleep = false;
+    wakeRequested = false;
+    enterPowerState(POWER_STATE_ACTIVE);
+    EVENT_DBUG_LOG(F("Radio awake"));
+  }
+}
+
+bool BlueCapPeripheral::isPowerIdle() {
+  return txQueueCount == 0 && commandQueueCount == 0 && !commandInFlight && cmdComplete &&
+         !txStreamActive && !hasEventBacklog();
+}
+
+void BlueCapPeripheral::managePower() {
+  if (!powerManaged) {
+    return;
+  }
+  if (radioAsleep && (commandQueueCount > 0 ||
+      millis() - radioSleepAt >= 1000UL * advertisingPauseSeconds)) {
+    wakeup();
+  }
+  if (!isPowerIdle()) {
+    return;
+  }
+  uint8_t awakeState = radioAsleep ? POWER_STATE_SLEEP : POWER_STATE_ACTIVE;
+  enterPowerState(radioAsleep ? POWER_STATE_SLEEP : POWER_STATE_IDLE);
+#if defined(__AVR__)
+  // idle mode keeps timer 0 running, so millis() and the wake deadline
+  // still advance and the CPU is back within a millisecond at most
+  cli();
+  if (!hasEventBacklog()) {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+  }
+  sei();
+#endif
+  enterPowerState(awakeState);
+}
@@ -0,0 +1,208 @@
+#include <SPI.h>
+#include "boards.h"
+#include "lib_aci.h"
+#include "aci_setup.h"
+#include "utils.h"
+
+#include "blue_cap_peripheral.h"
+
+#ifndef RECOVERY_MAX_RETRIES
+#define RECOVERY_MAX_RETRIES                          3
+#endif
+
+#ifndef RECOVERY_BACKOFF_MILLISECONDS
+#define RECOVERY_BACKOFF_MILLISECONDS                 100
+#endif
+
+#ifndef RECOVERY_RESET_TIMEOUT_MILLISECONDS
+#define RECOVERY_RESET_TIMEOUT_MILLISECONDS           1000
+#endif
+
+#define RECOVERY_MAX_BACKOFF_SHIFT                    6
+
+bool BlueCapPeripheral::isRecovering() {
+  return recovering;
+}
+
+uint16_t BlueCapPeripheral::commandErrorCount() {
+  return commandErrors;
+}
+
+uint16_t BlueCapPeripheral::radioResetCount() {
+  return radioResets;
+}
+
+uint16_t BlueCapPeripheral::recoveryCount() {
+  return recoveries;
+}
+
+uint32_t BlueCapPeripheral::lastRecoveryTime() {
+  return lastRecoveryMillis;
+}
+
+// private
+void BlueCapPeripheral::initRecovery() {
+  recovering = false;
+  recoveryStep = RECOVERY_IDLE;
+  recoveryAttempts = 0;
+  recoveryOpcode = 0;
+  recoveryAt = 0;
+  recoveryDelay = 0;
+  recoveryStartedAt = 0;
+  commandErrors = 0;
+  radioResets = 0;
+  recoveries = 0;
+  lastRecoveryMillis = 0;
+}
+
+bool BlueCapPeripheral::isAdvertisingCommand(uint8_t opcode) {
+  return ACI_CMD_CONNECT == opcode || ACI_CMD_BOND == opcode || ACI_CMD_BROADCAST == opcode;
+}
+
+uint8_t BlueCapPeripheral::classifyError(uint8_t opcode, uint8_t status) {
+  if (ACI_CMD_RADIO_RESET == opcode) {
+    return RECOVERY_RESTART;
+  }
+  switch (status) {
+    case ACI_STATUS_ERROR_BUSY:
+    case ACI_STATUS_ERROR_CREDIT_NOT_AVAILABLE:
+      // only advertising can be reissued, other commands are reported
+      return isAdvertisingCommand(opcode) ? RECOVERY_RETRY : RECOVERY_IDLE;
+    case ACI_STATUS_ERROR_INTERNAL:
+    case ACI_STATUS_ERROR_UNKNOWN:
+    case ACI_STATUS_ERROR_INVALID_SEQ_NO:
+    case ACI_STATUS_ERROR_CRC_MISMATCH:
+      return RECOVERY_RESET;
+    default:
+      // includes DEVICE_STATE_INVALID, the command does not apply while
+      // advertising or connected and the radio is fine
+      return RECOVERY_IDLE;
+  }
+}
+
+void BlueCapPeripheral::handleCommandError(uint8_t opcode, uint8_t status) {
+  commandErrors++;
+  EVENT_ERROR_LOG(F("ACI_EVT_CMD_RSP: Error"));
+  EVENT_ERROR_LOG(opcode, HEX);
+  EVENT_ERROR_LOG(status, HEX);
+  didReceiveCommandError(opcode, status);
+  uint8_t step = classifyError(opcode, status);
+  if (RECOVERY_RETRY == step && recoveryAttempts >= RECOVERY_MAX_RETRIES) {
+    step = RECOVERY_RESET;
+  }
+  if (RECOVERY_IDLE != step) {
+    scheduleRecovery(step, opcode);
+  }
+}
+
+void BlueCapPeripheral::scheduleRecovery(uint8_t step, uint8_t opcode) {
+  if (!recovering) {
+    recovering = true;
+    recoveryStartedAt = millis();
+    recoveryAttempts = 0;
+  }
+  uint8_t shift = recoveryAttempts < RECOVERY_MAX_BACKOFF_SHIFT ? recoveryAttempts : RECOVERY_MAX_BACKOFF_SHIFT;
+  recoveryDelay = (uint32_t)RECOVERY_BACKOFF_MILLISECONDS << shift;
+  if (recoveryAttempts < 0xFF) {
+    recoveryAttempts++;
+  }
+  recoveryStep = step;
+  recoveryOpcode = opcode;
+  recoveryAt = millis();
+  TRACE(TRACE_RECOVERY, step, opcode, recoveryAttempts);
+  EVENT_DBUG_LOG(F("Recovery step:"));
+  EVENT_DBUG_LOG(step, DEC);
+}
+
+void BlueCapPeripheral::manageRecovery() {
+  if (RECOVERY_IDLE == recoveryStep || millis() - recoveryAt < recoveryDelay) {
+    return;
+  }
+  uint8_t step = recoveryStep;
+  recoveryStep = RECOVERY_IDLE;
+  switch (step) {
+    case RECOVERY_RETRY:
+      // set before advertising, its response may arrive inside startAdvertising()
+      recoveryStep = RECOVERY_RETRYING;
+      recoveryAt = millis();
+      recoveryDelay = RECOVERY_RESET_TIMEOUT_MILLISECONDS;
+      startAdvertising();
+      break;
+    case RECOVERY_RETRYING:
+      EVENT_ERROR_LOG(F("Recovery: retry timed out"));
+      scheduleRecovery(RECOVERY_RESET, recoveryOpcode);
+      break;
+    case RECOVERY_RESET:
+      abortForRecovery();
+      radioResets++;
+      cmdComplete = false;
+      if (lib_aci_radio_reset()) {
+        recoveryStep = RECOVERY_RESETTING;
+        recoveryAt = millis();
+        recoveryDelay = RECOVERY_RESET_TIMEOUT_MILLISECONDS;
+      } else {
+        cmdComplete = true;
+        scheduleRecovery(RECOVERY_RESTART, ACI_CMD_RADIO_RESET);
+      }
+      break;
+    case RECOVERY_RESETTING:
+      EVENT_ERROR_LOG(F("Recovery: radio reset timed out"));
+      scheduleRecovery(RECOVERY_RESTART, ACI_CMD_RADIO_RESET);
+      break;
+    case RECOVERY_RESTART:
+      abortForRecovery();
+      radioResets++;
+      setup();
+      if (deviceStarted) {
+        finishRecovery();
+      } else if (RECOVERY_IDLE == recoveryStep) {
+        recoveryStep = RECOVERY_RESETTING;
+        recoveryAt = millis();
+        recoveryDelay = RECOVERY_RESET_TIMEOUT_MILLISECONDS;
+      }
+      break;
+  }
+}
+
+void BlueCapPeripheral::abortForRecovery() {
+  failQueuedCommand();
+  clearTxQueue();
+  endStream(false);
+  if (!isBondIdle()) {
+    bonding->bondOperation = BOND_IDLE;
+    TRACE(TRACE_BOND, BOND_IDLE, bonding->currentBondIndex, false);
+  }
+  isConnected = false;
+  memset(pipesOpen, 0, sizeof(pipesOpen));
+  aciState.data_credit_available = aciState.data_credit_total;
+  cmdComplete = true;
+}
+
+void BlueCapPeripheral::didResetRadio() {
+  // the nRF8001 answers RadioReset with a command response and no
+  // DEVICE_STARTED, so the response is where the radio is back in standby
+  deviceStarted = true;
+  if (aciState.data_credit_total == 0) {
+    aciState.data_credit_total = savedCreditTotal();
+  }
+  aciState.data_credit_available = aciState.data_credit_total;
+  startAdvertising();
+  if (RECOVERY_RESETTING == recoveryStep) {
+    finishRecovery();
+  }
+}
+
+void BlueCapPeripheral::finishRecovery() {
+  if (!recovering) {
+    return;
+  }
+  recovering = false;
+  recoveryStep = RECOVERY_IDLE;
+  recoveryAttempts = 0;
+  recoveries++;
+  lastRecoveryMillis = millis() - recoveryStartedAt;
+  TRACE(TRACE_RECOVERY, RECOVERY_IDLE, recoveryOpcode, 0);
+  EVENT_DBUG_LOG(F("Recovered in milliseconds:"));
+  EVENT_DBUG_LOG(lastRecoveryMillis, DEC);
+  didRecover(lastRecoveryMillis);
+}
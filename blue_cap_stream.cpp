@@ -0,0 +1,156 @@
+#include <SPI.h>
+#include "boards.h"
+#include "lib_aci.h"
+#include "aci_setup.h"
+#include "utils.h"
+
+#include "blue_cap_peripheral.h"
+
+#define STREAM_FRAGMENT_DATA_BYTES        (ACI_PIPE_TX_DATA_MAX_LEN - STREAM_HEADER_BYTES)
+
+bool BlueCapPeripheral::sendStream(uint8_t pipe, const uint8_t* buffer, uint32_t size) {
+  if (txStreamActive) {
+    STREAM_ERROR_LOG(F("sendStream: stream already in progress"));
+    return false;
+  }
+  if (!isPipeAvailable(pipe)) {
+    return false;
+  }
+  txStreamPipe = pipe;
+  txStreamBuffer = buffer;
+  txStreamSize = size;
+  txStreamOffset = 0;
+  txStreamSequence = 0;
+  txStreamActive = true;
+  STREAM_DBUG_LOG(F("sendStream started, size:"));
+  STREAM_DBUG_LOG(size, DEC);
+  sendStreamFragments();
+  return true;
+}
+
+bool BlueCapPeripheral::sendStream(uint8_t pipe, uint32_t size) {
+  return sendStream(pipe, NULL, size);
+}
+
+bool BlueCapPeripheral::isStreaming() {
+  return txStreamActive;
+}
+
+void BlueCapPeripheral::setStreamReceiveBuffer(uint8_t pipe, uint8_t* buffer, uint16_t size) {
+  rxStreamPipe = pipe;
+  rxStreamBuffer = buffer;
+  rxStreamCapacity = size;
+  rxStreamSize = 0;
+  rxStreamActive = false;
+}
+
+// private
+void BlueCapPeripheral::initStreams() {
+  txStreamBuffer = NULL;
+  txStreamActive = false;
+  rxStreamBuffer = NULL;
+  rxStreamCapacity = 0;
+  rxStreamSize = 0;
+  rxStreamActive = false;
+}
+
+void BlueCapPeripheral::sendStreamFragments() {
+  uint8_t fragment[ACI_PIPE_TX_DATA_MAX_LEN];
+  while (txStreamActive && canSendData()) {
+    if (!isPipeAvailable(txStreamPipe)) {
+      METRICS_COUNT(sendFailures);
+      TRACE(TRACE_SEND, false, txStreamPipe, 0);
+      endStream(false);
+      break;
+    }
+    uint32_t remaining = txStreamSize - txStreamOffset;
+    uint8_t size = remaining > STREAM_FRAGMENT_DATA_BYTES ? STREAM_FRAGMENT_DATA_BYTES : remaining;
+    if (txStreamBuffer != NULL) {
+      memcpy(fragment + STREAM_HEADER_BYTES, txStreamBuffer + txStreamOffset, size);
+    } else if (size > 0) {
+      uint8_t requested = size;
+      size = readStreamData(txStreamPipe, txStreamOffset, fragment + STREAM_HEADER_BYTES, requested);
+      if (size > requested) {
+        size = requested;
+      }
+      if (size == 0) {
+        STREAM_ERROR_LOG(F("sendStream: no data from readStreamData"));
+        endStream(false);
+        break;
+      }
+    }
+    bool last = (txStreamOffset + size) == txStreamSize;
+    fragment[0] = txStreamSequence & STREAM_SEQUENCE_MASK;
+    if (txStreamOffset == 0) {
+      fragment[0] |= STREAM_FIRST_FRAGMENT;
+    }
+    if (last) {
+      fragment[0] |= STREAM_LAST_FRAGMENT;
+    }
+    if (!lib_aci_send_data(txStreamPipe, fragment, size + STREAM_HEADER_BYTES)) {
+      break;
+    }
+    decrementCredit();
+    lastActivityAt = millis();
+    METRICS_PIPE(true, txStreamPipe, size + STREAM_HEADER_BYTES);
+    TRACE(TRACE_SEND, true, txStreamPipe, 0);
+    txStreamOffset += size;
+    txStreamSequence++;
+    if (last) {
+      endStream(true);
+    }
+  }
+}
+
+void BlueCapPeripheral::endStream(bool success) {
+  if (txStreamActive) {
+    txStreamActive = false;
+    if (success) {
+      STREAM_DBUG_LOG(F("sendStream complete"));
+    } else {
+      STREAM_ERROR_LOG(F("sendStream failed at offset:"));
+      STREAM_ERROR_LOG(txStreamOffset, DEC);
+    }
+    didSendStream(txStreamPipe, success);
+  }
+}
+
+bool BlueCapPeripheral::receiveStreamFragment(uint8_t pipe, uint8_t* data, uint8_t size) {
+  if (rxStreamBuffer == NULL || pipe != rxStreamPipe) {
+    return false;
+  }
+  if (size < STREAM_HEADER_BYTES) {
+    STREAM_ERROR_LOG(F("receiveStream: missing fragment header"));
+    return true;
+  }
+  uint8_t header = data[0];
+  if (header & STREAM_FIRST_FRAGMENT) {
+    rxStreamSize = 0;
+    rxStreamSequence = 0;
+    rxStreamActive = true;
+  }
+  if (!rxStreamActive) {
+    return true;
+  }
+  if ((header & STREAM_SEQUENCE_MASK) != (rxStreamSequence & STREAM_SEQUENCE_MASK)) {
+    STREAM_ERROR_LOG(F("receiveStream: fragment out of sequence"));
+    rxStreamActive = false;
+    return true;
+  }
+  size -= STREAM_HEADER_BYTES;
+  if (rxStreamSize + size > rxStreamCapacity) {
+    STREAM_ERROR_LOG(F("receiveStream: buffer overflow"));
+    rxStreamActive = false;
+    return true;
+  }
+  memcpy(rxStreamBuffer + rxStreamSize, data + STREAM_HEADER_BYTES, size);
+  rxStreamSize += size;
+  rxStreamSequence++;
+  if (header & STREAM_LAST_FRAGMENT) {
+    rxStreamActive = false;
+    STREAM_DBUG_LOG(F("receiveStream complete, size:"));
+    STREAM_DBUG_LOG(rxStreamSize, DEC);
+    didReceiveStream(pipe, rxStreamBuffer, rxStreamSize);
+  }
+  return true;
+}
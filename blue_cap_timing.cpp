@@ -0,0 +1,113 @@
+#include <SPI.h>
+#include "boards.h"
+#include "lib_aci.h"
+#include "aci_setup.h"
+#include "utils.h"
+
+#include "blue_cap_peripheral.h"
+
+#define THROUGHPUT_MIN_INTERVAL                       0x0006
+#define THROUGHPUT_MAX_INTERVAL                       0x000C
+#define THROUGHPUT_SLAVE_LATENCY                      0
+#define THROUGHPUT_TIMEOUT                            200
+
+#define LOW_POWER_MIN_INTERVAL                        0x0190
+#define LOW_POWER_MAX_INTERVAL                        0x0320
+#define LOW_POWER_SLAVE_LATENCY                       4
+#define LOW_POWER_TIMEOUT                             1200
+
+// Intervals are in 1.25 ms units and timeouts in 10 ms units. The
+// specification requires timeout > (1 + latency) * interval * 2.
+#if THROUGHPUT_TIMEOUT * 4 <= (1 + THROUGHPUT_SLAVE_LATENCY) * THROUGHPUT_MAX_INTERVAL
+#error "THROUGHPUT_TIMEOUT is too short for the throughput interval and latency"
+#endif
+
+#if LOW_POWER_TIMEOUT * 4 <= (1 + LOW_POWER_SLAVE_LATENCY) * LOW_POWER_MAX_INTERVAL
+#error "LOW_POWER_TIMEOUT is too short for the low power interval and latency"
+#endif
+
+#ifndef TIMING_IDLE_MILLISECONDS
+#define TIMING_IDLE_MILLISECONDS                      5000
+#endif
+
+#ifndef TIMING_MIN_CHANGE_MILLISECONDS
+#define TIMING_MIN_CHANGE_MILLISECONDS                10000
+#endif
+
+void BlueCapPeripheral::setAdaptiveTiming(bool enabled) {
+  adaptiveTiming = enabled;
+}
+
+uint8_t BlueCapPeripheral::timingProfile() {
+  return currentTimingProfile;
+}
+
+uint16_t BlueCapPeripheral::connectionInterval() {
+  return timingInterval;
+}
+
+uint16_t BlueCapPeripheral::slaveLatency() {
+  return timingLatency;
+}
+
+uint16_t BlueCapPeripheral::supervisionTimeout() {
+  return timingTimeout;
+}
+
+// private
+void BlueCapPeripheral::initTiming() {
+  adaptiveTiming = false;
+  currentTimingProfile = TIMING_PROFILE_DEFAULT;
+  timingInterval = 0;
+  timingLatency = 0;
+  timingTimeout = 0;
+  timingChangedAt = 0;
+  lastActivityAt = 0;
+}
+
+void BlueCapPeripheral::resetTiming() {
+  currentTimingProfile = TIMING_PROFILE_DEFAULT;
+  timingChangedAt = millis();
+  lastActivityAt = timingChangedAt;
+}
+
+void BlueCapPeripheral::updateTiming(uint16_t interval, uint16_t latency, uint16_t timeout) {
+  timingInterval = interval;
+  timingLatency = latency;
+  timingTimeout = timeout;
+  EVENT_DBUG_LOG(F("Connection interval:"));
+  EVENT_DBUG_LOG(interval, DEC);
+  didChangeTiming(interval, latency, timeout);
+}
+
+void BlueCapPeripheral::manageTiming() {
+  if (!adaptiveTiming || !isConnected || !timingChangeDone || !cmdComplete) {
+    return;
+  }
+  uint32_t now = millis();
+  if (now - timingChangedAt < TIMING_MIN_CHANGE_MILLISECONDS) {
+    return;
+  }
+  uint8_t profile = currentTimingProfile;
+  // busy once the caller's transmit queue is half full
+  if ((txQueueCount > 0 && txQueueCount >= (txQueueSize + 1) / 2) || txStreamActive) {
+    profile = TIMING_PROFILE_THROUGHPUT;
+  } else if (now - lastActivityAt >= TIMING_IDLE_MILLISECONDS) {
+    profile = TIMING_PROFILE_LOW_POWER;
+  }
+  if (profile == currentTimingProfile) {
+    return;
+  }
+  bool status;
+  if (TIMING_PROFILE_THROUGHPUT == profile) {
+    status = changeTiming(THROUGHPUT_MIN_INTERVAL, THROUGHPUT_MAX_INTERVAL, THROUGHPUT_SLAVE_LATENCY, THROUGHPUT_TIMEOUT);
+  } else {
+    status = changeTiming(LOW_POWER_MIN_INTERVAL, LOW_POWER_MAX_INTERVAL, LOW_POWER_SLAVE_LATENCY, LOW_POWER_TIMEOUT);
+  }
+  timingChangedAt = now;
+  if (status) {
+    currentTimingProfile = profile;
+    EVENT_DBUG_LOG(F("Timing profile:"));
+    EVENT_DBUG_LOG(profile, DEC);
+  }
+}
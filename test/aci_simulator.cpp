@@ -0,0 +1,396 @@
+#include "aci_simulator.h"
+#include "aci_setup.h"
+
+AciSimulator sim;
+
+void simReset() {
+  memset(&sim, 0, sizeof(sim));
+  sim.tickMicros = 10;
+  sim.credits = 2;
+  sim.startOnInit = true;
+  sim.startMode = ACI_DEVICE_STANDBY;
+  sim.startupMicros = 1000;
+  sim.commandMicros = 500;
+  sim.creditMicros = 7500;
+}
+
+void simPushEvent(uint32_t delayMicros, const hal_aci_evt_t* event) {
+  if (sim.eventCount == SIM_MAX_EVENTS) {
+    return;
+  }
+  uint32_t at = sim.now + delayMicros;
+  uint8_t i = sim.eventCount;
+  // keep the queue ordered by delivery time, FIFO among equal times
+  while (i > 0 && (int32_t)(sim.events[i - 1].at - at) > 0) {
+    sim.events[i] = sim.events[i - 1];
+    i--;
+  }
+  sim.events[i].at = at;
+  sim.events[i].data = *event;
+  sim.eventCount++;
+}
+
+void simCommandStatus(uint8_t opcode, uint8_t status) {
+  if (sim.statusCount < SIM_MAX_STATUSES) {
+    sim.statuses[sim.statusCount].opcode = opcode;
+    sim.statuses[sim.statusCount].status = status;
+    sim.statusCount++;
+  }
+}
+
+void simDropResponses(uint8_t opcode, uint8_t count) {
+  sim.droppedOpcode = opcode;
+  sim.droppedResponses = count;
+}
+
+uint16_t simCommandCount(uint8_t opcode) {
+  uint16_t count = 0;
+  for (uint16_t i = 0; i < sim.commandCount && i < SIM_MAX_COMMANDS; i++) {
+    if (sim.commands[i] == opcode) {
+      count++;
+    }
+  }
+  return count;
+}
+
+void simConnect(uint8_t openPipes) {
+  hal_aci_evt_t event;
+  memset(&event, 0, sizeof(event));
+  event.evt.evt_opcode = ACI_EVT_CONNECTED;
+  event.evt.len = 1 + sizeof(aci_evt_params_connected_t);
+  event.evt.params.connected.conn_rf_interval = 0x0018;
+  event.evt.params.connected.conn_rf_timeout = 0x0100;
+  simPushEvent(0, &event);
+  memset(&event, 0, sizeof(event));
+  event.evt.evt_opcode = ACI_EVT_PIPE_STATUS;
+  event.evt.len = 1 + sizeof(aci_evt_params_pipe_status_t);
+  event.evt.params.pipe_status.pipes_open_bitmap[0] = openPipes;
+  simPushEvent(0, &event);
+}
+
+void simDisconnect(uint8_t aciStatus) {
+  hal_aci_evt_t event;
+  memset(&event, 0, sizeof(event));
+  event.evt.evt_opcode = ACI_EVT_DISCONNECTED;
+  event.evt.len = 1 + sizeof(aci_evt_params_disconnected_t);
+  event.evt.params.disconnected.aci_status = aciStatus;
+  sim.packetsInFlight = 0;
+  simPushEvent(0, &event);
+}
+
+void simBondStatus(uint8_t status) {
+  hal_aci_evt_t event;
+  memset(&event, 0, sizeof(event));
+  event.evt.evt_opcode = ACI_EVT_BOND_STATUS;
+  event.evt.len = 1 + sizeof(aci_evt_params_bond_status_t);
+  event.evt.params.bond_status.status_code = status;
+  simPushEvent(0, &event);
+}
+
+void simSetDynamicData(uint8_t messages, uint8_t seed) {
+  sim.dynamicMessages = messages;
+  for (uint8_t i = 0; i < messages; i++) {
+    // first byte is the dynamic data sequence number
+    sim.dynamicData[i][0] = i + 1;
+    for (uint8_t j = 1; j < SIM_DYNAMIC_BYTES; j++) {
+      sim.dynamicData[i][j] = seed + 16*i + j;
+    }
+  }
+  sim.dynamicRead = 0;
+  sim.dynamicWritten = 0;
+  sim.dynamicMismatch = false;
+}
+
+static void recordCommand(uint8_t opcode) {
+  if (sim.commandCount < SIM_MAX_COMMANDS) {
+    sim.commands[sim.commandCount] = opcode;
+  }
+  sim.commandCount++;
+}
+
+static bool acceptCommand(uint8_t opcode) {
+  if (sim.busyCalls > 0) {
+    sim.busyCalls--;
+    return false;
+  }
+  recordCommand(opcode);
+  return true;
+}
+
+static uint8_t nextStatus(uint8_t opcode, uint8_t status) {
+  for (uint8_t i = 0; i < sim.statusCount; i++) {
+    if (sim.statuses[i].opcode == opcode) {
+      status = sim.statuses[i].status;
+      sim.statusCount--;
+      memmove(&sim.statuses[i], &sim.statuses[i + 1], (sim.statusCount - i)*sizeof(SimStatus));
+      break;
+    }
+  }
+  return status;
+}
+
+static void respond(uint8_t opcode, uint8_t status, const uint8_t* data, uint8_t size) {
+  if (sim.droppedResponses > 0 && sim.droppedOpcode == opcode) {
+    sim.droppedResponses--;
+    return;
+  }
+  hal_aci_evt_t event;
+  memset(&event, 0, sizeof(event));
+  event.evt.evt_opcode = ACI_EVT_CMD_RSP;
+  event.evt.len = 3 + size;
+  event.evt.params.cmd_rsp.cmd_opcode = opcode;
+  event.evt.params.cmd_rsp.cmd_status = nextStatus(opcode, status);
+  if (size > 0) {
+    memcpy(event.evt.params.cmd_rsp.params.padding, data, size);
+  }
+  simPushEvent(sim.commandMicros, &event);
+}
+
+static bool command(uint8_t opcode) {
+  if (!acceptCommand(opcode)) {
+    return false;
+  }
+  respond(opcode, ACI_STATUS_SUCCESS, NULL, 0);
+  return true;
+}
+
+static void deviceStarted(uint32_t delayMicros, uint8_t mode) {
+  hal_aci_evt_t event;
+  memset(&event, 0, sizeof(event));
+  event.evt.evt_opcode = ACI_EVT_DEVICE_STARTED;
+  event.evt.len = 1 + sizeof(aci_evt_params_device_started_t);
+  event.evt.params.device_started.device_mode = mode;
+  event.evt.params.device_started.credit_available = sim.credits;
+  simPushEvent(delayMicros, &event);
+}
+
+// Arduino core
+unsigned long millis() {
+  return sim.now / 1000;
+}
+
+unsigned long micros() {
+  return sim.now;
+}
+
+void delay(unsigned long ms) {
+  sim.now += 1000*ms;
+}
+
+int digitalRead(uint8_t pin) {
+  return HIGH;
+}
+
+void attachInterrupt(uint8_t interruptNumber, void (*handler)(), int mode) {
+}
+
+void detachInterrupt(uint8_t interruptNumber) {
+}
+
+void noInterrupts() {
+}
+
+void interrupts() {
+}
+
+// lib_aci
+void lib_aci_init(aci_state_t* aciState) {
+  aciState->data_credit_total = 0;
+  aciState->data_credit_available = 0;
+  sim.eventCount = 0;
+  sim.packetsInFlight = 0;
+  if (sim.startOnInit) {
+    deviceStarted(sim.startupMicros, sim.startMode);
+  }
+}
+
+aci_status_code_t do_aci_setup(aci_state_t* aciState) {
+  deviceStarted(sim.startupMicros, ACI_DEVICE_STANDBY);
+  return ACI_STATUS_TRANSACTION_COMPLETE;
+}
+
+bool lib_aci_event_peek(hal_aci_evt_t* aciData) {
+  if (sim.eventCount == 0 || (int32_t)(sim.events[0].at - sim.now) > 0) {
+    return false;
+  }
+  *aciData = sim.events[0].data;
+  return true;
+}
+
+bool lib_aci_event_get(aci_state_t* aciState, hal_aci_evt_t* aciData) {
+  sim.now += sim.tickMicros;
+  if (!lib_aci_event_peek(aciData)) {
+    return false;
+  }
+  sim.eventCount--;
+  memmove(&sim.events[0], &sim.events[1], sim.eventCount*sizeof(SimEvent));
+  if (ACI_EVT_DATA_CREDIT == aciData->evt.evt_opcode && sim.packetsInFlight > 0) {
+    sim.packetsInFlight -= aciData->evt.params.data_credit.credit;
+  }
+  return true;
+}
+
+// a data packet or a data request, either takes a credit that comes back
+// creditMicros later
+static bool sendPacket(const uint8_t* value, uint8_t size) {
+  if (sim.busyCalls > 0) {
+    sim.busyCalls--;
+    return false;
+  }
+  if (sim.packetsInFlight >= sim.credits) {
+    sim.creditOverrun = true;
+  }
+  sim.packetsInFlight++;
+  if (sim.packetsInFlight > sim.maxPacketsInFlight) {
+    sim.maxPacketsInFlight = sim.packetsInFlight;
+  }
+  sim.packetsSent++;
+  sim.bytesSent += size;
+  if (size > 0) {
+    memcpy(sim.lastPacket, value, size);
+  }
+  hal_aci_evt_t event;
+  memset(&event, 0, sizeof(event));
+  event.evt.evt_opcode = ACI_EVT_DATA_CREDIT;
+  event.evt.len = 2;
+  event.evt.params.data_credit.credit = 1;
+  simPushEvent(sim.creditMicros, &event);
+  return true;
+}
+
+bool lib_aci_send_data(uint8_t pipe, uint8_t* value, uint8_t size) {
+  return sendPacket(value, size);
+}
+
+bool lib_aci_send_ack(aci_state_t* aciState, const uint8_t pipe) {
+  return true;
+}
+
+bool lib_aci_send_nack(aci_state_t* aciState, const uint8_t pipe, const uint8_t errorCode) {
+  return true;
+}
+
+bool lib_aci_request_data(aci_state_t* aciState, uint8_t pipe) {
+  return sendPacket(NULL, 0);
+}
+
+bool lib_aci_set_local_data(aci_state_t* aciState, uint8_t pipe, uint8_t* value, uint8_t size) {
+  return command(ACI_CMD_SET_LOCAL_DATA);
+}
+
+bool lib_aci_set_tx_power(aci_device_output_power_t txPower) {
+  return command(ACI_CMD_SET_TX_POWER);
+}
+
+bool lib_aci_get_battery_level() {
+  if (!acceptCommand(ACI_CMD_GET_BATTERY_LEVEL)) {
+    return false;
+  }
+  uint8_t level[2] = {0x00, 0x04};
+  respond(ACI_CMD_GET_BATTERY_LEVEL, ACI_STATUS_SUCCESS, level, sizeof(level));
+  return true;
+}
+
+bool lib_aci_get_temperature() {
+  if (!acceptCommand(ACI_CMD_GET_TEMPERATURE)) {
+    return false;
+  }
+  uint8_t temperature[2] = {0x50, 0x00};
+  respond(ACI_CMD_GET_TEMPERATURE, ACI_STATUS_SUCCESS, temperature, sizeof(temperature));
+  return true;
+}
+
+bool lib_aci_device_version() {
+  if (!acceptCommand(ACI_CMD_GET_DEVICE_VERSION)) {
+    return false;
+  }
+  aci_evt_cmd_rsp_params_get_device_version_t version;
+  memset(&version, 0, sizeof(version));
+  version.configuration_id = 0x0102;
+  version.aci_version = 2;
+  respond(ACI_CMD_GET_DEVICE_VERSION, ACI_STATUS_SUCCESS, (const uint8_t*)&version, sizeof(version));
+  return true;
+}
+
+bool lib_aci_get_address() {
+  if (!acceptCommand(ACI_CMD_GET_DEVICE_ADDRESS)) {
+    return false;
+  }
+  uint8_t address[7] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x00};
+  respond(ACI_CMD_GET_DEVICE_ADDRESS, ACI_STATUS_SUCCESS, address, sizeof(address));
+  return true;
+}
+
+bool lib_aci_connect(uint16_t runTimeout, uint16_t advInterval) {
+  return command(ACI_CMD_CONNECT);
+}
+
+bool lib_aci_bond(uint16_t runTimeout, uint16_t advInterval) {
+  return command(ACI_CMD_BOND);
+}
+
+bool lib_aci_broadcast(const uint16_t timeout, const uint16_t advInterval) {
+  return command(ACI_CMD_BROADCAST);
+}
+
+bool lib_aci_change_timing(uint16_t minInterval, uint16_t maxInterval, uint16_t latency, uint16_t timeout) {
+  return command(ACI_CMD_CHANGE_TIMING);
+}
+
+bool lib_aci_change_timing_GAP_PPCP() {
+  return command(ACI_CMD_CHANGE_TIMING);
+}
+
+bool lib_aci_radio_reset() {
+  sim.packetsInFlight = 0;
+  return command(ACI_CMD_RADIO_RESET);
+}
+
+bool lib_aci_sleep() {
+  return acceptCommand(ACI_CMD_SLEEP);
+}
+
+bool lib_aci_wakeup() {
+  if (!acceptCommand(ACI_CMD_WAKEUP)) {
+    return false;
+  }
+  deviceStarted(sim.startupMicros, ACI_DEVICE_STANDBY);
+  return true;
+}
+
+bool lib_aci_read_dynamic_data() {
+  if (!acceptCommand(ACI_CMD_READ_DYNAMIC_DATA)) {
+    return false;
+  }
+  uint8_t index = sim.dynamicRead;
+  if (index >= sim.dynamicMessages) {
+    respond(ACI_CMD_READ_DYNAMIC_DATA, ACI_STATUS_ERROR_DEVICE_STATE_INVALID, NULL, 0);
+    return true;
+  }
+  sim.dynamicRead++;
+  uint8_t status = sim.dynamicRead == sim.dynamicMessages ? ACI_STATUS_TRANSACTION_COMPLETE : ACI_STATUS_TRANSACTION_CONTINUE;
+  respond(ACI_CMD_READ_DYNAMIC_DATA, status, sim.dynamicData[index], SIM_DYNAMIC_BYTES);
+  return true;
+}
+
+bool hal_aci_tl_send(hal_aci_data_t* aciCmd) {
+  uint8_t opcode = aciCmd->buffer[1];
+  if (!acceptCommand(opcode)) {
+    return false;
+  }
+  if (ACI_CMD_WRITE_DYNAMIC_DATA != opcode) {
+    respond(opcode, ACI_STATUS_SUCCESS, NULL, 0);
+    return true;
+  }
+  uint8_t index = sim.dynamicWritten;
+  if (index >= sim.dynamicMessages || aciCmd->buffer[0] != SIM_DYNAMIC_BYTES + 1 ||
+      memcmp(aciCmd->buffer + 2, sim.dynamicData[index], SIM_DYNAMIC_BYTES) != 0) {
+    sim.dynamicMismatch = true;
+    respond(opcode, ACI_STATUS_ERROR_INVALID_DATA, NULL, 0);
+    return true;
+  }
+  sim.dynamicWritten++;
+  uint8_t status = sim.dynamicWritten == sim.dynamicMessages ? ACI_STATUS_TRANSACTION_COMPLETE : ACI_STATUS_TRANSACTION_CONTINUE;
+  respond(opcode, status, NULL, 0);
+  return true;
+}
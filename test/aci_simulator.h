@@ -0,0 +1,79 @@
+#ifndef _ACI_SIMULATOR_H
+#define _ACI_SIMULATOR_H
+
+// A scripted nRF8001 behind the lib_aci API. The clock is virtual: it
+// advances by tickMicros each time the library polls for an event, so the
+// library's own wait loops drive time forward and every run is repeatable.
+
+#include "lib_aci.h"
+
+#define SIM_MAX_EVENTS                    64
+#define SIM_MAX_COMMANDS                  256
+#define SIM_MAX_STATUSES                  8
+#define SIM_MAX_DYNAMIC_MESSAGES          4
+#define SIM_DYNAMIC_BYTES                 12
+
+struct SimEvent {
+  uint32_t              at;
+  hal_aci_evt_t         data;
+};
+
+struct SimStatus {
+  uint8_t               opcode;
+  uint8_t               status;
+};
+
+struct AciSimulator {
+  uint32_t              now;
+  uint32_t              tickMicros;
+
+  // radio behaviour
+  uint8_t               credits;
+  bool                  startOnInit;
+  uint8_t               startMode;
+  uint32_t              startupMicros;
+  uint32_t              commandMicros;
+  uint32_t              creditMicros;
+  uint8_t               busyCalls;
+  uint8_t               droppedResponses;
+  uint8_t               droppedOpcode;
+
+  // scripted command statuses, consumed in order per opcode
+  SimStatus             statuses[SIM_MAX_STATUSES];
+  uint8_t               statusCount;
+
+  // bond data handed out by ReadDynamicData and expected by WriteDynamicData
+  uint8_t               dynamicMessages;
+  uint8_t               dynamicData[SIM_MAX_DYNAMIC_MESSAGES][SIM_DYNAMIC_BYTES];
+  uint8_t               dynamicRead;
+  uint8_t               dynamicWritten;
+  bool                  dynamicMismatch;
+
+  // what the library did
+  uint8_t               commands[SIM_MAX_COMMANDS];
+  uint16_t              commandCount;
+  uint16_t              packetsSent;
+  uint32_t              bytesSent;
+  uint8_t               lastPacket[ACI_PIPE_TX_DATA_MAX_LEN];
+  uint8_t               packetsInFlight;
+  uint8_t               maxPacketsInFlight;
+  bool                  creditOverrun;
+
+  SimEvent              events[SIM_MAX_EVENTS];
+  uint8_t               eventCount;
+};
+
+extern AciSimulator sim;
+
+void simReset();
+void simPushEvent(uint32_t delayMicros, const hal_aci_evt_t* event);
+void simCommandStatus(uint8_t opcode, uint8_t status);
+void simDropResponses(uint8_t opcode, uint8_t count);
+uint16_t simCommandCount(uint8_t opcode);
+
+void simConnect(uint8_t openPipes);
+void simDisconnect(uint8_t aciStatus);
+void simBondStatus(uint8_t status);
+void simSetDynamicData(uint8_t messages, uint8_t seed);
+
+#endif
@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <chrono>
+
+#include "test_peripheral.h"
+
+// Throughput and latency of the main operations against the simulated
+// radio. Rates and latencies are in the simulator's virtual time, so they
+// reflect the library's waits on credits and command responses under the
+// simulator's timing; host ns/op is the CPU cost of the library code.
+
+#define BENCH_SAMPLES                     1000
+#define BENCH_RESTORES                    100
+#define BENCH_PACKET_BYTES                ACI_PIPE_TX_DATA_MAX_LEN
+#define BENCH_EVENT_BATCH                 32
+#define BENCH_MAX_WAIT_MILLISECONDS       1000
+
+struct BenchResult {
+  uint32_t              samples[BENCH_SAMPLES];
+  uint16_t              count;
+  uint32_t              packets;
+  uint32_t              bytes;
+  uint32_t              startedAt;
+  uint32_t              elapsedMicros;
+  std::chrono::steady_clock::time_point hostStartedAt;
+  double                hostNanos;
+};
+
+static void startBench(BenchResult& result) {
+  memset(result.samples, 0, sizeof(result.samples));
+  result.count = 0;
+  result.packets = 0;
+  result.bytes = 0;
+  result.startedAt = sim.now;
+  result.hostStartedAt = std::chrono::steady_clock::now();
+}
+
+static void addSample(BenchResult& result, uint32_t micros) {
+  if (result.count < BENCH_SAMPLES) {
+    result.samples[result.count++] = micros;
+  }
+}
+
+static void finishBench(BenchResult& result) {
+  result.elapsedMicros = sim.now - result.startedAt;
+  std::chrono::duration<double, std::nano> host = std::chrono::steady_clock::now() - result.hostStartedAt;
+  result.hostNanos = host.count();
+}
+
+static void report(const char* name, BenchResult& result) {
+  std::sort(result.samples, result.samples + result.count);
+  double seconds = result.elapsedMicros/1e6;
+  printf("%-14s %6u %12.1f %12.1f %10lu %10lu %12.0f\n", name, result.count,
+         seconds > 0 ? result.packets/seconds : 0.0,
+         seconds > 0 ? result.bytes/seconds : 0.0,
+         (unsigned long)(result.count > 0 ? result.samples[result.count/2] : 0),
+         (unsigned long)(result.count > 0 ? result.samples[(99*result.count)/100] : 0),
+         result.count > 0 ? result.hostNanos/result.count : 0.0);
+}
+
+// Records when the callbacks the benchmarks wait on fire.
+template <class BASE>
+class BenchPeripheralBase : public TestPeripheralBase<BASE> {
+
+public:
+
+  BenchPeripheralBase(uint8_t _reqnPin, uint8_t _rdynPin) : TestPeripheralBase<BASE>(_reqnPin, _rdynPin) {init();};
+  BenchPeripheralBase(uint8_t _reqnPin, uint8_t _rdynPin, uint16_t _eepromOffset) : TestPeripheralBase<BASE>(_reqnPin, _rdynPin, _eepromOffset) {init();};
+
+  // returns false if count has not reached target within BENCH_MAX_WAIT_MILLISECONDS
+  bool runUntil(uint16_t& count, uint16_t target) {
+    uint32_t end = sim.now + 1000*BENCH_MAX_WAIT_MILLISECONDS;
+    while (count < target && (int32_t)(sim.now - end) < 0) {
+      this->loop();
+    }
+    return count >= target;
+  }
+
+  void setDispatchHandler(BlueCapPipeHandler handler) {
+    this->setPipeHandlers(handlers, TEST_PIPE + 1);
+    this->setPipeHandler(TEST_PIPE, handler, 0);
+  }
+
+  uint16_t                setDataResponses;
+  uint32_t                setDataResponseAt;
+  uint16_t                restoresDone;
+  uint32_t                restoreAt;
+
+protected:
+
+  virtual void didReceiveCommandResponse(uint8_t commandId, uint8_t* data, uint8_t size) {
+    TestPeripheralBase<BASE>::didReceiveCommandResponse(commandId, data, size);
+    if (ACI_CMD_SET_LOCAL_DATA == commandId) {
+      setDataResponses++;
+      setDataResponseAt = sim.now;
+    }
+  };
+
+  virtual void didRestoreBond(uint8_t index, bool success) {
+    TestPeripheralBase<BASE>::didRestoreBond(index, success);
+    if (success) {
+      restoresDone++;
+      restoreAt = sim.now;
+    }
+  };
+
+private:
+
+  void init() {
+    setDataResponses = 0;
+    setDataResponseAt = 0;
+    restoresDone = 0;
+    restoreAt = 0;
+  }
+
+  typename BASE::PipeHandler  handlers[TEST_PIPE + 1];
+
+};
+
+typedef BenchPeripheralBase<BlueCapPeripheral> BenchPeripheral;
+typedef BenchPeripheralBase<BlueCapBondedPeripheral<1> > BenchBondedPeripheral;
+
+static BenchResult result;
+static uint8_t value[BENCH_PACKET_BYTES];
+
+static void connected(BenchPeripheral& peripheral) {
+  peripheral.begin();
+  simConnect(TEST_PIPE_MASK);
+  peripheral.run(20);
+}
+
+static void benchSendData() {
+  BenchPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  connected(peripheral);
+  uint32_t bytesSent = sim.bytesSent;
+  startBench(result);
+  for (uint16_t i = 0; i < BENCH_SAMPLES; i++) {
+    uint32_t start = sim.now;
+    value[0] = i;
+    if (!peripheral.sendData(TEST_PIPE, value, sizeof(value))) {
+      break;
+    }
+    addSample(result, sim.now - start);
+    result.packets++;
+  }
+  finishBench(result);
+  result.bytes = sim.bytesSent - bytesSent;
+  report("sendData", result);
+}
+
+static void benchRequestData() {
+  BenchPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  connected(peripheral);
+  startBench(result);
+  for (uint16_t i = 0; i < BENCH_SAMPLES; i++) {
+    uint32_t start = sim.now;
+    if (!peripheral.requestData(TEST_PIPE)) {
+      break;
+    }
+    addSample(result, sim.now - start);
+    result.packets++;
+  }
+  finishBench(result);
+  report("requestData", result);
+}
+
+// from the call to the radio's response
+static void benchSetData() {
+  BenchPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  connected(peripheral);
+  startBench(result);
+  for (uint16_t i = 0; i < BENCH_SAMPLES; i++) {
+    uint32_t start = sim.now;
+    value[0] = i;
+    if (!peripheral.setData(TEST_PIPE, value, sizeof(value)) ||
+        !peripheral.runUntil(peripheral.setDataResponses, i + 1)) {
+      break;
+    }
+    addSample(result, peripheral.setDataResponseAt - start);
+    result.packets++;
+    result.bytes += sizeof(value);
+  }
+  finishBench(result);
+  report("setData", result);
+}
+
+// an advertising timeout moves to the next bond and restores it, timed from
+// the timeout to didRestoreBond
+static void benchBondRestore() {
+  RamStore store;
+  BenchBondedPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN, 0);
+  peripheral.setBondStore(&store);
+  peripheral.addBond();
+  peripheral.begin();
+  simSetDynamicData(2, 0x40);
+  simConnect(TEST_PIPE_MASK);
+  simBondStatus(ACI_BOND_STATUS_SUCCESS);
+  peripheral.run(20);
+  simDisconnect(ACI_STATUS_EXTENDED);
+  if (!peripheral.runUntil(peripheral.restoresDone, 1)) {
+    fprintf(stderr, "bond restore: no bond saved\n");
+    return;
+  }
+  startBench(result);
+  for (uint16_t i = 0; i < BENCH_RESTORES; i++) {
+    simSetDynamicData(2, 0x40);
+    uint32_t start = sim.now;
+    simDisconnect(ACI_STATUS_ERROR_ADVT_TIMEOUT);
+    if (!peripheral.runUntil(peripheral.restoresDone, i + 2)) {
+      break;
+    }
+    addSample(result, peripheral.restoreAt - start);
+    result.packets += sim.dynamicWritten;
+    result.bytes += sim.dynamicWritten*SIM_DYNAMIC_BYTES;
+  }
+  finishBench(result);
+  report("bond restore", result);
+}
+
+static uint32_t scheduledAt[BENCH_SAMPLES];
+static uint16_t dispatched;
+
+static void recordDispatch(BlueCapPeripheral* peripheral, uint8_t pipe, uint8_t* data, uint8_t size) {
+  if (dispatched < BENCH_SAMPLES) {
+    addSample(result, sim.now - scheduledAt[dispatched]);
+    result.packets++;
+    result.bytes += size;
+  }
+  dispatched++;
+}
+
+// data received events from the radio to the pipe handler through listen(),
+// in bursts of BENCH_EVENT_BATCH that arrive together and queue up behind
+// each other
+static void benchDispatch() {
+  BenchPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  connected(peripheral);
+  peripheral.setDispatchHandler(recordDispatch);
+  hal_aci_evt_t event;
+  memset(&event, 0, sizeof(event));
+  event.evt.evt_opcode = ACI_EVT_DATA_RECEIVED;
+  event.evt.len = 2 + BENCH_PACKET_BYTES;
+  event.evt.params.data_received.rx_data.pipe_number = TEST_PIPE;
+  dispatched = 0;
+  startBench(result);
+  for (uint16_t i = 0; i < BENCH_SAMPLES; i += BENCH_EVENT_BATCH) {
+    for (uint16_t j = i; j < i + BENCH_EVENT_BATCH && j < BENCH_SAMPLES; j++) {
+      scheduledAt[j] = sim.now;
+      simPushEvent(0, &event);
+    }
+    uint16_t target = std::min(i + BENCH_EVENT_BATCH, BENCH_SAMPLES);
+    if (!peripheral.runUntil(dispatched, target)) {
+      break;
+    }
+  }
+  finishBench(result);
+  report("listen", result);
+}
+
+int main() {
+  printf("%-14s %6s %12s %12s %10s %10s %12s\n", "operation", "ops", "packets/s", "bytes/s", "p50 us", "p99 us", "host ns/op");
+  simReset();
+  benchSendData();
+  simReset();
+  benchRequestData();
+  simReset();
+  benchSetData();
+  simReset();
+  benchBondRestore();
+  simReset();
+  benchDispatch();
+  return 0;
+}
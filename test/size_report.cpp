@@ -0,0 +1,36 @@
+#include <stdio.h>
+
+#include "blue_cap_peripheral.h"
+
+// Prints what each mode peripheral and each caller-owned buffer costs in
+// this build, and fails if a plain peripheral carries bond or broadcast state.
+#define REPORT(TYPE) printf("  %-42s %4u bytes\n", #TYPE, (unsigned)sizeof(TYPE))
+
+typedef BlueCapModePeripheral<BLUE_CAP_PLAIN> PlainPeripheral;
+typedef BlueCapBondedPeripheral<1> OneBondPeripheral;
+typedef BlueCapBondedPeripheral<4> FourBondPeripheral;
+
+int main() {
+  printf("peripherals\n");
+  REPORT(PlainPeripheral);
+  REPORT(OneBondPeripheral);
+  REPORT(FourBondPeripheral);
+  REPORT(BlueCapBroadcastingPeripheral);
+  printf("caller buffers, per entry\n");
+  REPORT(BlueCapTxPacket);
+  REPORT(BlueCapRxPacket);
+  REPORT(BlueCapCommandEntry);
+  REPORT(BlueCapBroadcastFrame);
+  REPORT(BlueCapPeripheral::PipeHandler);
+  REPORT(BlueCapPipeMetrics);
+  REPORT(BlueCapMetrics);
+  REPORT(BlueCapTraceRecord);
+  REPORT(hal_aci_evt_t);
+  bool plainSmallest = sizeof(PlainPeripheral) < sizeof(OneBondPeripheral) &&
+                       sizeof(OneBondPeripheral) < sizeof(FourBondPeripheral) &&
+                       sizeof(PlainPeripheral) < sizeof(BlueCapBroadcastingPeripheral);
+  if (!plainSmallest) {
+    fprintf(stderr, "a plain peripheral carries another mode's state\n");
+  }
+  return plainSmallest ? 0 : 1;
+}
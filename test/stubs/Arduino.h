@@ -0,0 +1,41 @@
+#ifndef _ARDUINO_H
+#define _ARDUINO_H
+
+// Host stand-in for the Arduino core, enough to build the library against
+// the ACI simulator. Time only moves when the simulator advances it.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define HIGH                              1
+#define LOW                               0
+#define HEX                               16
+#define DEC                               10
+
+#define MOSI                              11
+#define MISO                              12
+#define SCK                               13
+#define SPI_CLOCK_DIV8                    5
+
+#define F(string_literal)                 (string_literal)
+#define pgm_read_byte(address)            (*(const uint8_t*)(address))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+int digitalRead(uint8_t pin);
+void attachInterrupt(uint8_t interruptNumber, void (*handler)(), int mode);
+void detachInterrupt(uint8_t interruptNumber);
+void noInterrupts();
+void interrupts();
+
+class Print {
+
+public:
+
+  virtual size_t write(uint8_t value) = 0;
+
+};
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef _EEPROM_H
+#define _EEPROM_H
+
+#include <stdint.h>
+
+// only compiled for the ARDUINO configuration check, never linked
+struct EEPROMClass {
+  uint8_t read(int address);
+  void write(int address, uint8_t value);
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef _SPI_H
+#define _SPI_H
+
+#include "Arduino.h"
+
+#endif
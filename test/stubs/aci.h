@@ -0,0 +1,204 @@
+#ifndef _ACI_H
+#define _ACI_H
+
+// The subset of the nRF8001 ACI definitions the library uses, with the
+// opcode and status values of the nRF8001 datasheet.
+
+#include "Arduino.h"
+
+#define PIPES_ARRAY_SIZE                  8
+#define ACI_PIPE_TX_DATA_MAX_LEN          20
+#define ACI_PIPE_RX_DATA_MAX_LEN          20
+
+typedef uint8_t aci_status_code_t;
+
+enum {
+  ACI_CMD_SLEEP                           = 0x04,
+  ACI_CMD_WAKEUP                          = 0x05,
+  ACI_CMD_READ_DYNAMIC_DATA               = 0x07,
+  ACI_CMD_WRITE_DYNAMIC_DATA              = 0x08,
+  ACI_CMD_GET_DEVICE_VERSION              = 0x09,
+  ACI_CMD_GET_DEVICE_ADDRESS              = 0x0A,
+  ACI_CMD_GET_BATTERY_LEVEL               = 0x0B,
+  ACI_CMD_GET_TEMPERATURE                 = 0x0C,
+  ACI_CMD_SET_LOCAL_DATA                  = 0x0D,
+  ACI_CMD_RADIO_RESET                     = 0x0E,
+  ACI_CMD_CONNECT                         = 0x0F,
+  ACI_CMD_BOND                            = 0x10,
+  ACI_CMD_CHANGE_TIMING                   = 0x13,
+  ACI_CMD_SET_TX_POWER                    = 0x14,
+  ACI_CMD_BROADCAST                       = 0x1C
+};
+
+enum {
+  ACI_EVT_DEVICE_STARTED                  = 0x81,
+  ACI_EVT_ECHO                            = 0x82,
+  ACI_EVT_HW_ERROR                        = 0x83,
+  ACI_EVT_CMD_RSP                         = 0x84,
+  ACI_EVT_CONNECTED                       = 0x85,
+  ACI_EVT_DISCONNECTED                    = 0x86,
+  ACI_EVT_BOND_STATUS                     = 0x87,
+  ACI_EVT_PIPE_STATUS                     = 0x88,
+  ACI_EVT_TIMING                          = 0x89,
+  ACI_EVT_DATA_CREDIT                     = 0x8A,
+  ACI_EVT_DATA_ACK                        = 0x8B,
+  ACI_EVT_DATA_RECEIVED                   = 0x8C,
+  ACI_EVT_PIPE_ERROR                      = 0x8D
+};
+
+enum {
+  ACI_DEVICE_TEST                         = 0x01,
+  ACI_DEVICE_SETUP                        = 0x02,
+  ACI_DEVICE_STANDBY                      = 0x03,
+  ACI_DEVICE_SLEEP                        = 0x04
+};
+
+enum {
+  ACI_STATUS_SUCCESS                      = 0x00,
+  ACI_STATUS_TRANSACTION_CONTINUE         = 0x01,
+  ACI_STATUS_TRANSACTION_COMPLETE         = 0x02,
+  ACI_STATUS_EXTENDED                     = 0x03,
+  ACI_STATUS_ERROR_UNKNOWN                = 0x80,
+  ACI_STATUS_ERROR_INTERNAL               = 0x81,
+  ACI_STATUS_ERROR_CMD_UNKNOWN            = 0x82,
+  ACI_STATUS_ERROR_DEVICE_STATE_INVALID   = 0x83,
+  ACI_STATUS_ERROR_INVALID_LENGTH         = 0x84,
+  ACI_STATUS_ERROR_INVALID_PARAMETER      = 0x85,
+  ACI_STATUS_ERROR_BUSY                   = 0x86,
+  ACI_STATUS_ERROR_INVALID_DATA           = 0x87,
+  ACI_STATUS_ERROR_CRC_MISMATCH           = 0x88,
+  ACI_STATUS_ERROR_UNSUPPORTED_SETUP_FORMAT = 0x89,
+  ACI_STATUS_ERROR_INVALID_SEQ_NO         = 0x8A,
+  ACI_STATUS_ERROR_SETUP_LOCKED           = 0x8B,
+  ACI_STATUS_ERROR_LOCK_FAILED            = 0x8C,
+  ACI_STATUS_ERROR_BOND_REQUIRED          = 0x8D,
+  ACI_STATUS_ERROR_REJECTED               = 0x8E,
+  ACI_STATUS_ERROR_DATA_SIZE              = 0x8F,
+  ACI_STATUS_ERROR_PIPE_INVALID           = 0x90,
+  ACI_STATUS_ERROR_CREDIT_NOT_AVAILABLE   = 0x91,
+  ACI_STATUS_ERROR_PEER_ATT_ERROR         = 0x92,
+  ACI_STATUS_ERROR_ADVT_TIMEOUT           = 0x93
+};
+
+enum {
+  ACI_BOND_STATUS_SUCCESS                 = 0x00,
+  ACI_BOND_STATUS_FAILED                  = 0x01
+};
+
+typedef enum {
+  ACI_DEVICE_OUTPUT_POWER_MINUS_18DBM     = 0x00,
+  ACI_DEVICE_OUTPUT_POWER_MINUS_12DBM     = 0x01,
+  ACI_DEVICE_OUTPUT_POWER_MINUS_6DBM      = 0x02,
+  ACI_DEVICE_OUTPUT_POWER_0DBM            = 0x03
+} aci_device_output_power_t;
+
+typedef struct {
+  uint8_t               pipe_number;
+  uint8_t               aci_data[ACI_PIPE_RX_DATA_MAX_LEN];
+} aci_rx_data_t;
+
+typedef struct {
+  uint16_t              configuration_id;
+  uint8_t               aci_version;
+  uint8_t               setup_format;
+  uint32_t              setup_id;
+  uint8_t               setup_status;
+} __attribute__((packed)) aci_evt_cmd_rsp_params_get_device_version_t;
+
+typedef struct {
+  uint8_t               bd_addr_own[6];
+  uint8_t               bd_addr_type;
+} aci_evt_cmd_rsp_params_get_device_address_t;
+
+typedef struct {
+  uint16_t              battery_level;
+} aci_evt_cmd_rsp_params_get_battery_level_t;
+
+typedef struct {
+  int16_t               temperature_value;
+} aci_evt_cmd_rsp_params_get_temperature_t;
+
+typedef struct {
+  uint8_t               cmd_opcode;
+  uint8_t               cmd_status;
+  union {
+    uint8_t                                       padding[29];
+    aci_evt_cmd_rsp_params_get_device_version_t   get_device_version;
+    aci_evt_cmd_rsp_params_get_device_address_t   get_device_address;
+    aci_evt_cmd_rsp_params_get_battery_level_t    get_battery_level;
+    aci_evt_cmd_rsp_params_get_temperature_t      get_temperature;
+  } params;
+} aci_evt_params_cmd_rsp_t;
+
+typedef struct {
+  uint8_t               device_mode;
+  uint8_t               hw_error;
+  uint8_t               credit_available;
+} aci_evt_params_device_started_t;
+
+typedef struct {
+  uint8_t               addr_type;
+  uint8_t               dev_addr[6];
+  uint16_t              conn_rf_interval;
+  uint16_t              conn_slave_rf_latency;
+  uint16_t              conn_rf_timeout;
+  uint8_t               master_clock_accuracy;
+} __attribute__((packed)) aci_evt_params_connected_t;
+
+typedef struct {
+  uint8_t               aci_status;
+  uint8_t               btle_status;
+} aci_evt_params_disconnected_t;
+
+typedef struct {
+  uint8_t               status_code;
+} aci_evt_params_bond_status_t;
+
+typedef struct {
+  uint8_t               pipes_open_bitmap[PIPES_ARRAY_SIZE];
+  uint8_t               pipes_closed_bitmap[PIPES_ARRAY_SIZE];
+} aci_evt_params_pipe_status_t;
+
+typedef struct {
+  uint16_t              conn_rf_interval;
+  uint16_t              conn_slave_rf_latency;
+  uint16_t              conn_rf_timeout;
+} __attribute__((packed)) aci_evt_params_timing_t;
+
+typedef struct {
+  uint8_t               credit;
+} aci_evt_params_data_credit_t;
+
+typedef struct {
+  aci_rx_data_t         rx_data;
+} aci_evt_params_data_received_t;
+
+typedef struct {
+  uint8_t               pipe_number;
+  uint8_t               error_code;
+  uint8_t               error_data[ACI_PIPE_TX_DATA_MAX_LEN];
+} aci_evt_params_pipe_error_t;
+
+typedef struct {
+  uint8_t               len;
+  uint8_t               evt_opcode;
+  union {
+    aci_evt_params_device_started_t   device_started;
+    aci_evt_params_cmd_rsp_t          cmd_rsp;
+    aci_evt_params_connected_t        connected;
+    aci_evt_params_disconnected_t     disconnected;
+    aci_evt_params_bond_status_t      bond_status;
+    aci_evt_params_pipe_status_t      pipe_status;
+    aci_evt_params_timing_t           timing;
+    aci_evt_params_data_credit_t      data_credit;
+    aci_evt_params_data_received_t    data_received;
+    aci_evt_params_pipe_error_t       pipe_error;
+  } params;
+} aci_evt_t;
+
+typedef struct {
+  uint8_t               location;
+  uint8_t               pipe_type;
+} services_pipe_type_mapping_t;
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef _ACI_SETUP_H
+#define _ACI_SETUP_H
+
+#include "lib_aci.h"
+
+aci_status_code_t do_aci_setup(aci_state_t* aciState);
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef _BOARDS_H
+#define _BOARDS_H
+
+#define REDBEARLAB_SHIELD_V1_1            1
+#define UNUSED                            255
+
+#endif
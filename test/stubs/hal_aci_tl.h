@@ -0,0 +1,20 @@
+#ifndef _HAL_ACI_TL_H
+#define _HAL_ACI_TL_H
+
+#include "aci.h"
+
+#define HAL_ACI_MAX_LENGTH                31
+
+typedef struct {
+  uint8_t               status_byte;
+  uint8_t               buffer[HAL_ACI_MAX_LENGTH + 1];
+} hal_aci_data_t;
+
+typedef struct {
+  uint8_t               status_byte;
+  aci_evt_t             evt;
+} hal_aci_evt_t;
+
+bool hal_aci_tl_send(hal_aci_data_t* aciCmd);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef _LIB_ACI_H
+#define _LIB_ACI_H
+
+// Host declarations of the RedBearLab lib_aci API. test/aci_simulator.cpp
+// implements them against a scripted nRF8001.
+
+#include "aci.h"
+#include "hal_aci_tl.h"
+
+typedef struct {
+  uint8_t               board_name;
+  uint8_t               reqn_pin;
+  uint8_t               rdyn_pin;
+  uint8_t               mosi_pin;
+  uint8_t               miso_pin;
+  uint8_t               sck_pin;
+  uint8_t               spi_clock_divider;
+  uint8_t               reset_pin;
+  uint8_t               active_pin;
+  uint8_t               optional_chip_sel_pin;
+  bool                  interface_is_interrupt;
+  uint8_t               interrupt_number;
+} aci_pins_t;
+
+typedef struct {
+  services_pipe_type_mapping_t*   services_pipe_type_mapping;
+  uint8_t                         number_of_pipes;
+  hal_aci_data_t*                 setup_msgs;
+  uint8_t                         num_setup_msgs;
+} aci_setup_info_t;
+
+typedef struct {
+  aci_pins_t            aci_pins;
+  aci_setup_info_t      aci_setup_info;
+  uint8_t               bonded;
+  uint8_t               data_credit_total;
+  uint8_t               data_credit_available;
+  uint8_t               pipes_open_bitmap[PIPES_ARRAY_SIZE];
+  uint8_t               pipes_closed_bitmap[PIPES_ARRAY_SIZE];
+} aci_state_t;
+
+void lib_aci_init(aci_state_t* aciState);
+bool lib_aci_event_get(aci_state_t* aciState, hal_aci_evt_t* aciData);
+bool lib_aci_event_peek(hal_aci_evt_t* aciData);
+
+bool lib_aci_send_data(uint8_t pipe, uint8_t* value, uint8_t size);
+bool lib_aci_send_ack(aci_state_t* aciState, const uint8_t pipe);
+bool lib_aci_send_nack(aci_state_t* aciState, const uint8_t pipe, const uint8_t errorCode);
+bool lib_aci_request_data(aci_state_t* aciState, uint8_t pipe);
+
+bool lib_aci_set_local_data(aci_state_t* aciState, uint8_t pipe, uint8_t* value, uint8_t size);
+bool lib_aci_set_tx_power(aci_device_output_power_t txPower);
+bool lib_aci_get_battery_level();
+bool lib_aci_get_temperature();
+bool lib_aci_device_version();
+bool lib_aci_get_address();
+bool lib_aci_connect(uint16_t runTimeout, uint16_t advInterval);
+bool lib_aci_bond(uint16_t runTimeout, uint16_t advInterval);
+bool lib_aci_broadcast(const uint16_t timeout, const uint16_t advInterval);
+bool lib_aci_change_timing(uint16_t minInterval, uint16_t maxInterval, uint16_t latency, uint16_t timeout);
+bool lib_aci_change_timing_GAP_PPCP();
+bool lib_aci_radio_reset();
+bool lib_aci_sleep();
+bool lib_aci_wakeup();
+bool lib_aci_read_dynamic_data();
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef _UTILS_H
+#define _UTILS_H
+
+// the host build keeps the serial log quiet
+#define DBUG_LOG(...)
+#define ERROR_LOG(...)
+
+#endif
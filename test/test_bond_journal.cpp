@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "test_peripheral.h"
+
+#define STORE_BYTES                       RAM_STORE_BYTES
+#define BOND_SLOT_OFFSET(SLOT)            ((SLOT)*BOND_RECORD_BYTES)
+
+static char storePath[64];
+
+static bool openStore(BlueCapFileStore& store) {
+  return store.open(storePath, STORE_BYTES);
+}
+
+// bonds a central to bond 0 and disconnects, which saves the bond data and
+// restores it into the radio before advertising again
+static void saveBond(TestBondedPeripheral& peripheral, uint8_t seed) {
+  simSetDynamicData(2, seed);
+  simConnect(TEST_PIPE_MASK);
+  simBondStatus(ACI_BOND_STATUS_SUCCESS);
+  peripheral.run(20);
+  simDisconnect(ACI_STATUS_EXTENDED);
+  peripheral.run(20);
+}
+
+static void testSaveAndRestoreBond() {
+  BlueCapFileStore store;
+  CHECK(openStore(store));
+  TestBondedPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN, 0);
+  peripheral.setBondStore(&store);
+  CHECK(peripheral.addBond());
+  peripheral.begin();
+  CHECK(simCommandCount(ACI_CMD_BOND) == 1);
+  saveBond(peripheral, 0x20);
+  CHECK(peripheral.saves == 1);
+  CHECK(peripheral.saveSucceeded);
+  CHECK(peripheral.isBonded(0));
+  CHECK(sim.dynamicRead == 2);
+  CHECK(peripheral.restores == 1);
+  CHECK(peripheral.restoreSucceeded);
+  CHECK(sim.dynamicWritten == 2);
+  CHECK(!sim.dynamicMismatch);
+  CHECK(simCommandCount(ACI_CMD_CONNECT) == 1);
+}
+
+static void testBondSurvivesReopen() {
+  BlueCapFileStore store;
+  CHECK(openStore(store));
+  {
+    TestBondedPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN, 0);
+    peripheral.setBondStore(&store);
+    peripheral.addBond();
+    peripheral.begin();
+    saveBond(peripheral, 0x30);
+    CHECK(peripheral.isBonded(0));
+  }
+  store.close();
+  CHECK(openStore(store));
+
+  simReset();
+  simSetDynamicData(2, 0x30);
+  TestBondedPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN, 0);
+  peripheral.setBondStore(&store);
+  CHECK(peripheral.isBonded(0));
+  CHECK(!peripheral.isBonded(1));
+  peripheral.begin();
+  peripheral.run(20);
+  CHECK(peripheral.restores == 1);
+  CHECK(peripheral.restoreSucceeded);
+  CHECK(!sim.dynamicMismatch);
+  CHECK(simCommandCount(ACI_CMD_BOND) == 0);
+}
+
+static void testCorruptRecordIsDropped() {
+  BlueCapFileStore store;
+  CHECK(openStore(store));
+  {
+    TestBondedPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN, 0);
+    peripheral.setBondStore(&store);
+    peripheral.addBond();
+    peripheral.begin();
+    saveBond(peripheral, 0x40);
+    CHECK(peripheral.isBonded(0));
+  }
+  // the first save goes to slot 0, skip the length and opcode bytes
+  uint16_t addr = BOND_SLOT_OFFSET(0) + BOND_RECORD_HEADER_BYTES + 2;
+  store.write(addr, store.read(addr) ^ 0x01);
+
+  TestBondedPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN, 0);
+  peripheral.setBondStore(&store);
+  CHECK(!peripheral.isBonded(0));
+  CHECK(peripheral.bondCount() == 0);
+}
+
+static void testNewestRecordWins() {
+  BlueCapFileStore store;
+  CHECK(openStore(store));
+  TestBondedPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN, 0);
+  peripheral.setBondStore(&store);
+  peripheral.addBond();
+  peripheral.begin();
+  saveBond(peripheral, 0x50);
+  CHECK(store.read(BOND_SLOT_OFFSET(0) + BOND_RECORD_SEQUENCE) == 1);
+
+  peripheral.clearBondData();
+  CHECK(!peripheral.isBonded(0));
+  CHECK(peripheral.addBond());
+  saveBond(peripheral, 0x60);
+  CHECK(peripheral.saves == 2);
+  CHECK(peripheral.isBonded(0));
+  CHECK(store.read(BOND_SLOT_OFFSET(0) + BOND_RECORD_MARKER) == BOND_RECORD_CLEARED);
+  CHECK(store.read(BOND_SLOT_OFFSET(1) + BOND_RECORD_MARKER) == BOND_RECORD_COMMITTED);
+  CHECK(store.read(BOND_SLOT_OFFSET(1) + BOND_RECORD_SEQUENCE) == 2);
+
+  // both slots hold a record, the directory must pick the later one
+  simReset();
+  simSetDynamicData(2, 0x60);
+  TestBondedPeripheral reopened(TEST_REQN_PIN, TEST_RDYN_PIN, 0);
+  reopened.setBondStore(&store);
+  CHECK(reopened.isBonded(0));
+  reopened.begin();
+  reopened.run(20);
+  CHECK(reopened.restoreSucceeded);
+  CHECK(!sim.dynamicMismatch);
+}
+
+static void testTornSaveKeepsNoBond() {
+  RamStore store;
+  TestBondedPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN, 0);
+  peripheral.setBondStore(&store);
+  peripheral.addBond();
+  peripheral.begin();
+  // enough for the slot marker and part of the bond data
+  store.writesLeft = 10;
+  saveBond(peripheral, 0x70);
+  CHECK(store.writesLeft == 0);
+
+  store.writesLeft = -1;
+  TestBondedPeripheral restarted(TEST_REQN_PIN, TEST_RDYN_PIN, 0);
+  restarted.setBondStore(&store);
+  CHECK(!restarted.isBonded(0));
+
+  simReset();
+  restarted.addBond();
+  restarted.begin();
+  saveBond(restarted, 0x70);
+  CHECK(restarted.saveSucceeded);
+  CHECK(restarted.restoreSucceeded);
+  CHECK(!sim.dynamicMismatch);
+
+  TestBondedPeripheral reread(TEST_REQN_PIN, TEST_RDYN_PIN, 0);
+  reread.setBondStore(&store);
+  CHECK(reread.isBonded(0));
+}
+
+static void resetStore() {
+  unlink(storePath);
+  simReset();
+}
+
+#define RUN_STORE_TEST(TEST)                                                    \
+  do {                                                                          \
+    resetStore();                                                               \
+    RUN_TEST(TEST);                                                             \
+  } while (0)
+
+int main() {
+  strcpy(storePath, "/tmp/blue_cap_bondsXXXXXX");
+  int fd = mkstemp(storePath);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+  RUN_STORE_TEST(testSaveAndRestoreBond);
+  RUN_STORE_TEST(testBondSurvivesReopen);
+  RUN_STORE_TEST(testCorruptRecordIsDropped);
+  RUN_STORE_TEST(testNewestRecordWins);
+  RUN_STORE_TEST(testTornSaveKeepsNoBond);
+  unlink(storePath);
+  return testFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,96 @@
+#include "test_peripheral.h"
+
+#define TEST_FRAMES                       2
+#define TEST_COMMANDS                     4
+
+static BlueCapBroadcastFrame frames[TEST_FRAMES];
+static BlueCapCommandEntry commands[TEST_COMMANDS];
+
+static void setUp(TestBroadcastingPeripheral& peripheral) {
+  CHECK(peripheral.setCommandQueue(commands, TEST_COMMANDS));
+  CHECK(peripheral.setBroadcastFrames(frames, TEST_FRAMES));
+}
+
+static void testFrameSetBeforeBeginIsPushed() {
+  TestBroadcastingPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  setUp(peripheral);
+  uint8_t value[4] = {1, 2, 3, 4};
+  CHECK(peripheral.setBroadcastFrame(0, TEST_PIPE, value, sizeof(value), 1000));
+  CHECK(simCommandCount(ACI_CMD_SET_LOCAL_DATA) == 0);
+  peripheral.begin();
+  peripheral.run(500);
+  CHECK(simCommandCount(ACI_CMD_SET_LOCAL_DATA) == 1);
+  CHECK(peripheral.setDataSucceeded == 1);
+  CHECK(peripheral.setDataFailed == 0);
+  CHECK(frames[0].pushed);
+}
+
+static void testFailedPushIsRetried() {
+  TestBroadcastingPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  setUp(peripheral);
+  peripheral.begin();
+  peripheral.run(5);
+  simCommandStatus(ACI_CMD_SET_LOCAL_DATA, ACI_STATUS_ERROR_BUSY);
+  uint8_t value[4] = {5, 6, 7, 8};
+  CHECK(peripheral.setBroadcastFrame(0, TEST_PIPE, value, sizeof(value), 1000));
+  CHECK(!frames[0].pushed);
+  peripheral.run(5);
+  CHECK(peripheral.setDataFailed == 1);
+  CHECK(peripheral.setDataSucceeded == 1);
+  CHECK(simCommandCount(ACI_CMD_SET_LOCAL_DATA) == 2);
+  CHECK(frames[0].pushed);
+}
+
+static void testChangeDuringPushIsPushedAgain() {
+  TestBroadcastingPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  setUp(peripheral);
+  peripheral.begin();
+  peripheral.run(5);
+  uint8_t value[4] = {1, 1, 1, 1};
+  CHECK(peripheral.setBroadcastFrame(0, TEST_PIPE, value, sizeof(value), 1000));
+  value[0] = 2;
+  CHECK(peripheral.setBroadcastFrame(0, TEST_PIPE, value, sizeof(value), 1000));
+  peripheral.run(5);
+  CHECK(simCommandCount(ACI_CMD_SET_LOCAL_DATA) == 2);
+  CHECK(frames[0].pushed);
+}
+
+static void testFramesRotate() {
+  TestBroadcastingPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  setUp(peripheral);
+  uint8_t first[2] = {1, 1};
+  uint8_t second[2] = {2, 2};
+  CHECK(peripheral.setBroadcastFrame(0, TEST_PIPE, first, sizeof(first), 100));
+  CHECK(peripheral.setBroadcastFrame(1, TEST_PIPE, second, sizeof(second), 100));
+  peripheral.begin();
+  peripheral.run(50);
+  CHECK(peripheral.broadcastFrame() == 0);
+  CHECK(frames[0].pushed && !frames[1].pushed);
+  peripheral.run(100);
+  CHECK(peripheral.broadcastFrame() == 1);
+  CHECK(!frames[0].pushed && frames[1].pushed);
+  CHECK(simCommandCount(ACI_CMD_SET_LOCAL_DATA) == 2);
+}
+
+static void testPlainPeripheralHasNoFrames() {
+  TestPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  CHECK(peripheral.setCommandQueue(commands, TEST_COMMANDS));
+  CHECK(!peripheral.setBroadcastFrames(frames, TEST_FRAMES));
+  uint8_t value[4] = {1, 2, 3, 4};
+  CHECK(!peripheral.setBroadcastFrame(0, TEST_PIPE, value, sizeof(value), 1000));
+  CHECK(peripheral.bondCount() == 0);
+  CHECK(!peripheral.addBond());
+  peripheral.begin();
+  peripheral.run(100);
+  CHECK(simCommandCount(ACI_CMD_SET_LOCAL_DATA) == 0);
+  CHECK(simCommandCount(ACI_CMD_CONNECT) == 1);
+}
+
+int main() {
+  RUN_TEST(testFrameSetBeforeBeginIsPushed);
+  RUN_TEST(testFailedPushIsRetried);
+  RUN_TEST(testChangeDuringPushIsPushedAgain);
+  RUN_TEST(testFramesRotate);
+  RUN_TEST(testPlainPeripheralHasNoFrames);
+  return testFailures == 0 ? 0 : 1;
+}
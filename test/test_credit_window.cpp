@@ -0,0 +1,133 @@
+#include "test_peripheral.h"
+
+#define CREDIT_PACKETS                    40
+#define TEST_TX_QUEUE_SIZE                4
+
+static BlueCapTxPacket txQueue[TEST_TX_QUEUE_SIZE];
+
+static void connected(TestPeripheral& peripheral) {
+  peripheral.begin();
+  simConnect(TEST_PIPE_MASK);
+  peripheral.run(20);
+}
+
+static uint32_t sendPackets(TestPeripheral& peripheral, uint16_t count) {
+  uint8_t value[ACI_PIPE_TX_DATA_MAX_LEN];
+  uint32_t start = sim.now;
+  for (uint16_t i = 0; i < count; i++) {
+    memset(value, i, sizeof(value));
+    CHECK(peripheral.sendData(TEST_PIPE, value, sizeof(value)));
+  }
+  return sim.now - start;
+}
+
+static void testPipelinedSendUsesWholeWindow() {
+  sim.credits = 4;
+  TestPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  connected(peripheral);
+  uint32_t elapsed = sendPackets(peripheral, CREDIT_PACKETS);
+  CHECK(sim.packetsSent == CREDIT_PACKETS);
+  CHECK(sim.maxPacketsInFlight == 4);
+  CHECK(!sim.creditOverrun);
+  printf("  pipelined: %u packets in %lu us\n", CREDIT_PACKETS, (unsigned long)elapsed);
+}
+
+static void testStopAndWaitKeepsOnePacketInFlight() {
+  sim.credits = 4;
+  TestPeripheral pipelined(TEST_REQN_PIN, TEST_RDYN_PIN);
+  connected(pipelined);
+  uint32_t pipelinedTime = sendPackets(pipelined, CREDIT_PACKETS);
+
+  simReset();
+  sim.credits = 4;
+  TestPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  peripheral.setStopAndWait(true);
+  connected(peripheral);
+  uint32_t stopAndWaitTime = sendPackets(peripheral, CREDIT_PACKETS);
+  CHECK(sim.packetsSent == CREDIT_PACKETS);
+  CHECK(sim.maxPacketsInFlight == 1);
+  CHECK(stopAndWaitTime > 3*pipelinedTime);
+  printf("  stop-and-wait: %u packets in %lu us\n", CREDIT_PACKETS, (unsigned long)stopAndWaitTime);
+}
+
+static void testPipeMetricsCoverEveryPipe() {
+  BlueCapMetrics metrics;
+  BlueCapPipeMetrics pipes[TEST_PIPE];
+  TestPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  CHECK(!peripheral.setMetrics(&metrics, pipes, 0));
+  // too small for TEST_PIPE, its traffic lands in otherPipes
+  CHECK(peripheral.setMetrics(&metrics, pipes, TEST_PIPE));
+  connected(peripheral);
+  sendPackets(peripheral, 3);
+  CHECK(metrics.otherPipes.txPackets == 3);
+  CHECK(metrics.otherPipes.txBytes == 3*ACI_PIPE_TX_DATA_MAX_LEN);
+
+  BlueCapPipeMetrics allPipes[TEST_PIPE + 1];
+  CHECK(peripheral.setMetrics(&metrics, allPipes, TEST_PIPE + 1));
+  sendPackets(peripheral, 2);
+  CHECK(allPipes[TEST_PIPE].txPackets == 2);
+  CHECK(metrics.otherPipes.txPackets == 0);
+}
+
+static void testQueuedSendRetriesFullAciQueue() {
+  sim.credits = 2;
+  TestPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  connected(peripheral);
+  uint8_t value[4] = {1, 2, 3, 4};
+  CHECK(!peripheral.enqueueData(TEST_PIPE, value, sizeof(value)));
+  CHECK(peripheral.setTransmitQueue(txQueue, TEST_TX_QUEUE_SIZE));
+  sim.busyCalls = 1;
+  CHECK(peripheral.enqueueData(TEST_PIPE, value, sizeof(value)));
+  CHECK(sim.packetsSent == 0);
+  CHECK(peripheral.txQueueDepth() == 1);
+  peripheral.run(1);
+  CHECK(sim.packetsSent == 1);
+  CHECK(peripheral.txQueueDepth() == 0);
+  CHECK(peripheral.dataSent == 1);
+  CHECK(peripheral.dataFailed == 0);
+}
+
+static void testQueuedSendWaitsForCredit() {
+  sim.credits = 2;
+  TestPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  connected(peripheral);
+  CHECK(peripheral.setTransmitQueue(txQueue, TEST_TX_QUEUE_SIZE));
+  uint8_t value[4];
+  for (uint8_t i = 0; i < TEST_TX_QUEUE_SIZE; i++) {
+    value[0] = i;
+    CHECK(peripheral.enqueueData(TEST_PIPE, value, sizeof(value)));
+  }
+  CHECK(sim.packetsSent == 2);
+  CHECK(peripheral.packetsInFlight() == 2);
+  peripheral.run(50);
+  CHECK(sim.packetsSent == TEST_TX_QUEUE_SIZE);
+  CHECK(sim.lastPacket[0] == TEST_TX_QUEUE_SIZE - 1);
+  CHECK(peripheral.dataSent == TEST_TX_QUEUE_SIZE);
+  CHECK(!sim.creditOverrun);
+}
+
+static void testDisconnectFailsQueuedData() {
+  sim.credits = 1;
+  TestPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  connected(peripheral);
+  CHECK(peripheral.setTransmitQueue(txQueue, TEST_TX_QUEUE_SIZE));
+  uint8_t value[4] = {0};
+  CHECK(peripheral.enqueueData(TEST_PIPE, value, sizeof(value)));
+  CHECK(peripheral.enqueueData(TEST_PIPE, value, sizeof(value)));
+  simDisconnect(ACI_STATUS_SUCCESS);
+  peripheral.run(1);
+  CHECK(peripheral.dataSent == 1);
+  CHECK(peripheral.dataFailed == 1);
+  CHECK(peripheral.txQueueDepth() == 0);
+  CHECK(peripheral.packetsInFlight() == 0);
+}
+
+int main() {
+  RUN_TEST(testPipelinedSendUsesWholeWindow);
+  RUN_TEST(testStopAndWaitKeepsOnePacketInFlight);
+  RUN_TEST(testPipeMetricsCoverEveryPipe);
+  RUN_TEST(testQueuedSendRetriesFullAciQueue);
+  RUN_TEST(testQueuedSendWaitsForCredit);
+  RUN_TEST(testDisconnectFailsQueuedData);
+  return testFailures == 0 ? 0 : 1;
+}
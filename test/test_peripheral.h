@@ -0,0 +1,135 @@
+#ifndef _TEST_PERIPHERAL_H
+#define _TEST_PERIPHERAL_H
+
+#include <stdio.h>
+
+#include "aci_simulator.h"
+#include "blue_cap_peripheral.h"
+
+#define TEST_REQN_PIN                     9
+#define TEST_RDYN_PIN                     8
+#define TEST_PIPE                         1
+#define TEST_PIPE_MASK                    (1 << TEST_PIPE)
+
+static int testFailures = 0;
+
+#define CHECK(CONDITION)                                                        \
+  do {                                                                          \
+    if (!(CONDITION)) {                                                         \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #CONDITION); \
+      testFailures++;                                                           \
+    }                                                                           \
+  } while (0)
+
+#define RUN_TEST(TEST)                                                          \
+  do {                                                                          \
+    int failures = testFailures;                                                \
+    simReset();                                                                 \
+    TEST();                                                                     \
+    printf("%s %s\n", failures == testFailures ? "PASS" : "FAIL", #TEST);       \
+  } while (0)
+
+#define RAM_STORE_BYTES                   512
+
+// RAM backed store that drops every write after writesLeft reaches zero,
+// standing in for power lost partway through a save.
+class RamStore : public BlueCapBondStore {
+
+public:
+
+  RamStore() : writesLeft(-1) {memset(data, 0xFF, sizeof(data));};
+
+  virtual uint8_t read(uint16_t addr) {return data[addr];};
+  virtual void write(uint16_t addr, uint8_t value) {
+    if (writesLeft == 0) {
+      return;
+    }
+    if (writesLeft > 0) {
+      writesLeft--;
+    }
+    data[addr] = value;
+    written++;
+  };
+
+  int                     writesLeft;
+  uint8_t                 data[RAM_STORE_BYTES];
+
+};
+
+static hal_aci_data_t testSetupMessages[1] = {{0x00, {0x02, 0x06, 0x01}}};
+static services_pipe_type_mapping_t testPipeMapping[2] = {{0x01, 0x02}, {0x01, 0x04}};
+
+// Records the callbacks the tests look at. Used with BlueCapPeripheral
+// and with the mode peripherals through the BASE parameter.
+template <class BASE>
+class TestPeripheralBase : public BASE {
+
+public:
+
+  TestPeripheralBase(uint8_t _reqnPin, uint8_t _rdynPin) : BASE(_reqnPin, _rdynPin) {init();};
+  TestPeripheralBase(uint8_t _reqnPin, uint8_t _rdynPin, uint16_t _eepromOffset) : BASE(_reqnPin, _rdynPin, _eepromOffset) {init();};
+
+  void run(uint32_t milliseconds) {
+    uint32_t end = sim.now + 1000*milliseconds;
+    while ((int32_t)(sim.now - end) < 0) {
+      this->loop();
+    }
+  }
+
+  uint16_t                dataSent;
+  uint16_t                dataFailed;
+  uint16_t                advertisingStarts;
+  uint16_t                connects;
+  uint16_t                commandErrors;
+  uint8_t                 lastErrorOpcode;
+  uint16_t                recovered;
+  uint16_t                temperatures;
+  uint16_t                setDataSucceeded;
+  uint16_t                setDataFailed;
+  uint8_t                 saves;
+  bool                    saveSucceeded;
+  uint8_t                 restores;
+  bool                    restoreSucceeded;
+
+protected:
+
+  virtual void didSendData(uint8_t pipe, bool success) {if (success) {dataSent++;} else {dataFailed++;}};
+  virtual void didStartAdvertising() {advertisingStarts++;};
+  virtual void didConnect() {connects++;};
+  virtual void didReceiveCommandError(uint8_t commandId, uint8_t status) {commandErrors++; lastErrorOpcode = commandId;};
+  virtual void didRecover(uint32_t milliseconds) {recovered++;};
+  virtual void didReceiveCommandResponse(uint8_t commandId, uint8_t* data, uint8_t size) {if (ACI_CMD_GET_TEMPERATURE == commandId) {temperatures++;}};
+  virtual void didSetData(uint8_t pipe, bool success) {if (success) {setDataSucceeded++;} else {setDataFailed++;}};
+  virtual void didSaveBond(uint8_t index, bool success) {saves++; saveSucceeded = success;};
+  virtual void didRestoreBond(uint8_t index, bool success) {restores++; restoreSucceeded = success;};
+
+private:
+
+  void init() {
+    dataSent = 0;
+    dataFailed = 0;
+    advertisingStarts = 0;
+    connects = 0;
+    commandErrors = 0;
+    lastErrorOpcode = 0;
+    recovered = 0;
+    temperatures = 0;
+    setDataSucceeded = 0;
+    setDataFailed = 0;
+    saves = 0;
+    saveSucceeded = false;
+    restores = 0;
+    restoreSucceeded = false;
+    this->setServicePipeTypeMapping(testPipeMapping, 2);
+    this->setSetUpMessages(testSetupMessages, 1);
+  }
+
+};
+
+typedef TestPeripheralBase<BlueCapPeripheral> TestPeripheral;
+
+typedef TestPeripheralBase<BlueCapBondedPeripheral<2> > TestBondedPeripheral;
+
+typedef TestPeripheralBase<BlueCapBroadcastingPeripheral> TestBroadcastingPeripheral;
+
+#endif
@@ -0,0 +1,135 @@
+#include "test_peripheral.h"
+
+static void testBusyConnectIsRetried() {
+  simCommandStatus(ACI_CMD_CONNECT, ACI_STATUS_ERROR_BUSY);
+  TestPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  peripheral.begin();
+  peripheral.run(10);
+  CHECK(peripheral.isRecovering());
+  CHECK(peripheral.commandErrors == 1);
+  CHECK(peripheral.lastErrorOpcode == ACI_CMD_CONNECT);
+  peripheral.run(200);
+  CHECK(!peripheral.isRecovering());
+  CHECK(peripheral.recovered == 1);
+  CHECK(peripheral.recoveryCount() == 1);
+  CHECK(peripheral.radioResetCount() == 0);
+  CHECK(simCommandCount(ACI_CMD_CONNECT) == 2);
+}
+
+static void testLocalCommandDoesNotFinishRetry() {
+  simCommandStatus(ACI_CMD_CONNECT, ACI_STATUS_ERROR_BUSY);
+  TestPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  peripheral.begin();
+  peripheral.run(10);
+  // answered during the backoff, before the connect is reissued
+  CHECK(peripheral.getTemperature());
+  peripheral.run(5);
+  CHECK(peripheral.temperatures == 1);
+  CHECK(simCommandCount(ACI_CMD_CONNECT) == 1);
+  CHECK(peripheral.isRecovering());
+  CHECK(peripheral.recovered == 0);
+  peripheral.run(200);
+  CHECK(!peripheral.isRecovering());
+  CHECK(peripheral.recovered == 1);
+  CHECK(simCommandCount(ACI_CMD_CONNECT) == 2);
+}
+
+static void testInternalErrorResetsRadio() {
+  simCommandStatus(ACI_CMD_CONNECT, ACI_STATUS_ERROR_INTERNAL);
+  TestPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  peripheral.begin();
+  peripheral.run(200);
+  CHECK(simCommandCount(ACI_CMD_RADIO_RESET) == 1);
+  CHECK(peripheral.radioResetCount() == 1);
+  CHECK(!peripheral.isRecovering());
+  CHECK(peripheral.recovered == 1);
+  CHECK(simCommandCount(ACI_CMD_CONNECT) == 2);
+  CHECK(peripheral.advertisingStarts == 2);
+
+  // credits survive the reset, the response carries no DEVICE_STARTED
+  uint8_t value[4] = {0};
+  simConnect(TEST_PIPE_MASK);
+  peripheral.run(5);
+  CHECK(peripheral.sendData(TEST_PIPE, value, sizeof(value)));
+  CHECK(peripheral.sendData(TEST_PIPE, value, sizeof(value)));
+  CHECK(sim.maxPacketsInFlight == 2);
+  CHECK(!sim.creditOverrun);
+}
+
+static void testInvalidStateIsReported() {
+  simCommandStatus(ACI_CMD_GET_TEMPERATURE, ACI_STATUS_ERROR_DEVICE_STATE_INVALID);
+  TestPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  peripheral.begin();
+  peripheral.run(5);
+  CHECK(peripheral.getTemperature());
+  peripheral.run(2000);
+  CHECK(peripheral.commandErrors == 1);
+  CHECK(peripheral.lastErrorOpcode == ACI_CMD_GET_TEMPERATURE);
+  CHECK(!peripheral.isRecovering());
+  CHECK(simCommandCount(ACI_CMD_RADIO_RESET) == 0);
+  CHECK(peripheral.temperatures == 0);
+}
+
+static void testLostRetryResponseEscalates() {
+  simCommandStatus(ACI_CMD_CONNECT, ACI_STATUS_ERROR_BUSY);
+  TestPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  peripheral.begin();
+  peripheral.run(10);
+  CHECK(peripheral.isRecovering());
+  simDropResponses(ACI_CMD_CONNECT, 1);
+  peripheral.run(500);
+  CHECK(peripheral.isRecovering());
+  CHECK(simCommandCount(ACI_CMD_RADIO_RESET) == 0);
+  peripheral.run(1000);
+  CHECK(simCommandCount(ACI_CMD_RADIO_RESET) == 1);
+  CHECK(!peripheral.isRecovering());
+  CHECK(peripheral.recovered == 1);
+  CHECK(peripheral.radioResetCount() == 1);
+}
+
+static void testFastStartupSkipsSetup() {
+  RamStore store;
+  sim.credits = 3;
+  sim.startMode = ACI_DEVICE_SETUP;
+  {
+    TestPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+    peripheral.setBondStore(&store);
+    peripheral.enableFastStartup(0);
+    peripheral.begin();
+    peripheral.run(5);
+    CHECK(peripheral.advertisingStarts == 1);
+  }
+
+  // a configured radio sends no DEVICE_STARTED
+  simReset();
+  sim.credits = 3;
+  sim.startOnInit = false;
+  TestPeripheral peripheral(TEST_REQN_PIN, TEST_RDYN_PIN);
+  peripheral.setBondStore(&store);
+  peripheral.enableFastStartup(0);
+  peripheral.begin();
+  CHECK(peripheral.startupTime() < 10);
+  CHECK(simCommandCount(ACI_CMD_GET_DEVICE_VERSION) == 1);
+  CHECK(simCommandCount(ACI_CMD_RADIO_RESET) == 0);
+  CHECK(peripheral.advertisingStarts == 1);
+  printf("  fast startup: %lu ms\n", (unsigned long)peripheral.startupTime());
+
+  uint8_t value[4] = {0};
+  simConnect(TEST_PIPE_MASK);
+  peripheral.run(5);
+  for (uint8_t i = 0; i < 3; i++) {
+    CHECK(peripheral.sendData(TEST_PIPE, value, sizeof(value)));
+  }
+  CHECK(sim.maxPacketsInFlight == 3);
+  CHECK(!sim.creditOverrun);
+}
+
+int main() {
+  RUN_TEST(testBusyConnectIsRetried);
+  RUN_TEST(testLocalCommandDoesNotFinishRetry);
+  RUN_TEST(testInternalErrorResetsRadio);
+  RUN_TEST(testInvalidStateIsReported);
+  RUN_TEST(testLostRetryResponseEscalates);
+  RUN_TEST(testFastStartupSkipsSetup);
+  return testFailures == 0 ? 0 : 1;
+}
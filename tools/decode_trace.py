@@ -0,0 +1,78 @@
+#!/usr/bin/env python
+# Decode a BlueCapPeripheral::dumpTrace() capture.
+#
+#   python decode_trace.py capture.bin
+
+import struct
+import sys
+
+TRACE_DUMP_MAGIC = 0xBC
+RECORD = struct.Struct('<BBBBI')
+
+TRACE_IDS = {
+  0x01: 'EVENT',
+  0x02: 'CREDIT',
+  0x03: 'SEND',
+  0x04: 'COMMAND',
+  0x05: 'BOND',
+  0x06: 'RECOVERY',
+}
+
+EVENTS = {
+  0x81: 'DEVICE_STARTED',
+  0x82: 'ECHO',
+  0x83: 'HW_ERROR',
+  0x84: 'CMD_RSP',
+  0x85: 'CONNECTED',
+  0x86: 'DISCONNECTED',
+  0x87: 'BOND_STATUS',
+  0x88: 'PIPE_STATUS',
+  0x89: 'TIMING',
+  0x8A: 'DATA_CREDIT',
+  0x8B: 'DATA_ACK',
+  0x8C: 'DATA_RECEIVED',
+  0x8D: 'PIPE_ERROR',
+  0x8E: 'DISPLAY_PASSKEY',
+  0x8F: 'KEY_REQUEST',
+}
+
+BOND_OPERATIONS = {0: 'IDLE', 1: 'RESTORING', 2: 'SAVING'}
+
+RECOVERY_STEPS = {0: 'IDLE', 1: 'RETRY', 2: 'RESET', 3: 'RESETTING', 4: 'RESTART'}
+
+def describe(id, opcode, pipe, value):
+  if id == 0x01:
+    return '%-16s pipe=%d len=%d' % (EVENTS.get(opcode, '0x%02X' % opcode), pipe, value)
+  if id == 0x02:
+    return '%-16s available=%d' % ('refill' if opcode else 'consume', value)
+  if id == 0x03:
+    return '%-16s pipe=%d' % ('ok' if opcode else 'failed', pipe)
+  if id == 0x04:
+    return '%-16s' % ('ok' if opcode else 'failed')
+  if id == 0x05:
+    return '%-16s bond=%d value=%d' % (BOND_OPERATIONS.get(opcode, opcode), pipe, value)
+  if id == 0x06:
+    return '%-16s command=0x%02X value=%d' % (RECOVERY_STEPS.get(opcode, opcode), pipe, value)
+  return 'opcode=0x%02X pipe=%d value=%d' % (opcode, pipe, value)
+
+def decode(data):
+  offset = data.find(bytes(bytearray([TRACE_DUMP_MAGIC])))
+  if offset < 0 or offset + 2 > len(data):
+    raise ValueError('no trace dump found')
+  count = bytearray(data)[offset + 1]
+  offset += 2
+  start = None
+  for i in range(count):
+    if offset + RECORD.size > len(data):
+      raise ValueError('trace truncated after %d of %d records' % (i, count))
+    id, opcode, pipe, value, timestamp = RECORD.unpack_from(data, offset)
+    offset += RECORD.size
+    if start is None:
+      start = timestamp
+    print('%10d us  %-8s %s' % ((timestamp - start) & 0xFFFFFFFF, TRACE_IDS.get(id, id), describe(id, opcode, pipe, value)))
+
+if __name__ == '__main__':
+  if len(sys.argv) != 2:
+    sys.exit('usage: decode_trace.py capture.bin')
+  with open(sys.argv[1], 'rb') as f:
+    decode(f.read())